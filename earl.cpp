@@ -9,8 +9,10 @@
 // Includes
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
 #include <string>
 #include <vector>
+#include <new>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
@@ -18,11 +20,32 @@
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
+#include <atomic>
 
 #if defined(_MSC_VER) && _MSC_VER
 #include <iso646.h>
 #endif
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <errno.h>
+
+#if PY_VERSION_HEX < 0x03090000
+#define PyObject_Vectorcall _PyObject_Vectorcall
+#endif
+
+// presizing and inserting with a known hash went private in 3.13
+#if PY_VERSION_HEX < 0x030D0000
+#define earl_dict_presized _PyDict_NewPresized
+#define earl_dict_set_known_hash _PyDict_SetItem_KnownHash
+#else
+#define earl_dict_presized(size) PyDict_New()
+#define earl_dict_set_known_hash(dict, key, value, hash) PyDict_SetItem(dict, key, value)
+#endif
+
 // External Term Format Defines
 const char FORMAT_VERSION = '\x83';
 const char FLOAT_IEEE_EXT = 'F';
@@ -46,11 +69,21 @@ const char ATOM_UTF_SMALL_EXT = 'w';
 const char COMPRESSED_TERM = 'P';
 
 extern "C" {
-static PyObject* earl_pack(PyObject* self, PyObject* args, PyObject* kwargs);
-static PyObject* earl_unpack(PyObject* self, PyObject* args, PyObject* kwargs);
+static PyObject* earl_pack(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_unpack(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_pack_to(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_pack_iov(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_pack_chunked(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_peek(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_validate(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+static PyObject* earl_register_record(PyObject* self, PyObject* args, PyObject* kwargs);
 // our custom exception types
 PyObject* earl_DecodeError;
 PyObject* earl_EncodeError;
+PyObject* matcher_type;
+PyObject* key_cache_type;
+PyObject* dedupe_type;
+PyObject* chunk_type;
 }
 
 struct encode_type {
@@ -93,800 +126,4942 @@ static void as_big_endian64(unsigned char* buffer, uint64_t integer) {
     buffer[7] = integer >> 0;
 }
 
-struct packer {
-    packer(const char* encoding, int encode_mode):
-        encoding(encoding), encode_mode(encode_mode) {}
+static void encode_atom(std::string& out, const char* bytes, uint16_t size) {
+    if(size < 255) {
+        out.push_back(SMALL_ATOM_EXT);
+        out.push_back(static_cast<unsigned char>(size));
+        out.append(bytes, size);
+        return;
+    }
 
-    PyObject* pack(PyObject* obj) {
-        buffer.reserve(1024 * 1024);
-        append_version();
-        if(pack_object(obj)) {
-            // error happened
-            if(PyErr_Occurred()) {
-                return NULL;
-            }
-            else {
-                PyErr_SetString(earl_EncodeError, "An unknown error occurred while packing.");
-                return NULL;
-            }
+    unsigned char buf[3];
+    buf[0] = ATOM_EXT;
+    as_big_endian16(buf + 1, size);
+    out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+    out.append(bytes, size);
+}
+
+// an Erlang record registered with register_record
+struct record_entry {
+    std::string tag;        // the tag atom's name as UTF-8
+    Py_ssize_t arity;       // size of the tuple, including the tag
+    PyObject* factory;
+    bool fill_tuple;        // a NamedTuple whose storage can be filled in directly
+};
+
+static std::vector<record_entry> records;
+
+// so UTF-8, by far the most common encoding, can skip the codec machinery
+static bool is_utf8(const char* encoding) {
+    if(encoding == NULL) {
+        return false;
+    }
+
+    const char* expected = "utf8";
+    for(; *encoding; ++encoding) {
+        char c = *encoding;
+        if(c == '-' || c == '_') {
+            continue;
         }
-        return PyBytes_FromStringAndSize(&buffer[0], buffer.size());
+
+        if(*expected == '\0' || (c | 0x20) != *expected) {
+            return false;
+        }
+        ++expected;
     }
-private:
-    std::string buffer;
+    return *expected == '\0';
+}
+
+struct pack_options {
+    pack_options():
+        encoding("utf-8"), utf8(true), encode_mode(encode_type::bytes),
+        namedtuple_as_record(false), enum_as_atom(false), deterministic(false) {}
+
+    void set_encoding(const char* name) {
+        encoding = name;
+        utf8 = is_utf8(name);
+    }
+
     const char* encoding;
+    bool utf8;
     int encode_mode;
+    bool namedtuple_as_record;
+    bool enum_as_atom;
+    bool deterministic;     // maps and sets in Erlang term order
+};
 
-    void append_version() {
-        buffer.push_back(FORMAT_VERSION);
+struct key_cache;
+struct dedupe_table;
+
+struct unpack_options {
+    unpack_options():
+        encoding(NULL), utf8(false), encode_binary_ext(false), keys(NULL), dedupe(NULL) {}
+
+    void set_encoding(const char* name) {
+        encoding = name;
+        utf8 = is_utf8(name);
     }
 
-    void append_nil() {
-        buffer.push_back(SMALL_ATOM_EXT);
-        buffer.push_back(3);
-        buffer.push_back('n');
-        buffer.push_back('i');
-        buffer.push_back('l');
+    const char* encoding;   // NULL leaves STRING_EXT and BINARY_EXT as bytes
+    bool utf8;
+    bool encode_binary_ext;
+    key_cache* keys;        // UTF-8 map keys shared between calls, if any
+    dedupe_table* dedupe;   // immutable terms to share, if any
+};
+
+struct plan_kind {
+    enum {
+        none = 0,
+        dataclass = 1,
+        namedtuple = 2,
+        enumeration = 3,
+        mapping = 4,      // anything else packed through items()
+        iterable = 5      // anything else packed by iterating over it
+    };
+};
+
+struct field_plan {
+    std::string key;      // the field name, already encoded as an atom
+    PyObject* name;       // interned attribute name
+    Py_ssize_t offset;    // where a __slots__ member lives in the instance, -1 otherwise
+};
+
+// how to pack instances of a class that isn't one of the builtin types
+struct type_plan {
+    type_plan(): kind(plan_kind::none) {}
+
+    ~type_plan() {
+        for(size_t i = 0; i < fields.size(); ++i) {
+            Py_XDECREF(fields[i].name);
+        }
     }
 
-    void append_true() {
-        buffer.push_back(SMALL_ATOM_EXT);
-        buffer.push_back(4);
-        buffer.push_back('t');
-        buffer.push_back('r');
-        buffer.push_back('u');
-        buffer.push_back('e');
+    int kind;
+    std::string tag;      // the class name encoded as an atom, for record tuples
+    std::vector<field_plan> fields;
+};
+
+// weak reference to a type -> capsule holding its type_plan, filled the first time a class
+// is packed. the references remove their entry when the class goes away
+static PyObject* type_plans;
+static PyObject* forget_type_plan;
+
+// earl.CHUNK, which marks where the elements go in a pack_chunked envelope. it packs
+// as an atom no str can produce, since 0xFF never appears in UTF-8
+static PyObject* chunk_marker;
+static const char CHUNK_ATOM[] = "s\x0b\xff" "earl.CHUNK";
+
+static void type_plan_destructor(PyObject* capsule) {
+    delete reinterpret_cast<type_plan*>(PyCapsule_GetPointer(capsule, "earl.type_plan"));
+}
+
+static bool is_exact_builtin(PyTypeObject* type) {
+    return type == &PyLong_Type || type == &PyUnicode_Type || type == &PyFloat_Type ||
+           type == &PyDict_Type || type == &PyList_Type || type == &PyTuple_Type ||
+           type == &PyBytes_Type || type == &PyBool_Type || type == Py_TYPE(Py_None) ||
+           type == &PyByteArray_Type || type == &PySet_Type || type == &PyFrozenSet_Type ||
+           type == &PyMemoryView_Type;
+}
+
+// subclasses of these are packed like the builtin itself
+static bool is_builtin_subtype(PyTypeObject* type) {
+    static PyTypeObject* const builtins[] = {
+        &PyLong_Type, &PyUnicode_Type, &PyFloat_Type, &PyList_Type, &PyTuple_Type, &PyBytes_Type,
+        &PyByteArray_Type, &PySet_Type, &PyFrozenSet_Type, &PyMemoryView_Type
+    };
+
+    for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if(PyType_IsSubtype(type, builtins[i])) {
+            return true;
+        }
     }
 
-    void append_false() {
-        buffer.push_back(SMALL_ATOM_EXT);
-        buffer.push_back(5);
-        buffer.push_back('f');
-        buffer.push_back('a');
-        buffer.push_back('l');
-        buffer.push_back('s');
-        buffer.push_back('e');
+    // dict subclasses that iterate in their own order, like OrderedDict, go through items()
+    return PyType_IsSubtype(type, &PyDict_Type) && type->tp_iter == PyDict_Type.tp_iter;
+}
+
+static int is_mapping_class(PyTypeObject* type) {
+    if(PyType_IsSubtype(type, &PyDict_Type)) {
+        return 1;
     }
 
-    void append_small_integer(uint8_t integer) {
-        buffer.push_back(SMALL_INTEGER_EXT);
-        buffer.push_back(integer);
+    PyObject* abc = PyImport_ImportModule("collections.abc");
+    if(abc == NULL) {
+        return -1;
     }
 
-    void append_integer(int32_t integer) {
-        unsigned char bytes[5]; // 1 + sizeof(integer)
-        bytes[0] = INTEGER_EXT;
-        as_big_endian32(bytes + 1, integer);
-        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    PyObject* base = PyObject_GetAttrString(abc, "Mapping");
+    Py_DECREF(abc);
+    if(base == NULL) {
+        return -1;
     }
 
-    void append_uint64_t(uint64_t integer) {
-        unsigned char bytes[11]; // 3 + sizeof(integer)
-        pack_long_long(bytes, integer);
-        bytes[2] = 0;
-        buffer.append(reinterpret_cast<const char*>(bytes), 3 + bytes[1]);
+    int ret = PyObject_IsSubclass(reinterpret_cast<PyObject*>(type), base);
+    Py_DECREF(base);
+    return ret;
+}
+
+// returns 1 on error
+static int plan_atom(std::string& out, PyObject* name) {
+    Py_ssize_t size;
+    const char* text = PyUnicode_AsUTF8AndSize(name, &size);
+    if(text == NULL) {
+        return 1;
     }
 
-    void append_int64_t(int64_t integer) {
-        unsigned char bytes[11];
-        uint64_t value;
-        if(integer < 0) {
-            bytes[2] = 1;
-            value = -integer;
+    if(size > UINT16_MAX) {
+        PyErr_SetString(earl_EncodeError, "name too big to be encoded as ATOM_EXT");
+        return 1;
+    }
+    encode_atom(out, text, size);
+    return 0;
+}
+
+static int plan_dataclass(PyTypeObject* type, type_plan* plan) {
+    PyObject* dataclasses = PyImport_ImportModule("dataclasses");
+    if(dataclasses == NULL) {
+        return 1;
+    }
+
+    PyObject* fields = PyObject_CallMethod(dataclasses, "fields", "O", type);
+    Py_DECREF(dataclasses);
+    if(fields == NULL) {
+        return 1;
+    }
+
+    PyObject* fast = PySequence_Fast(fields, "dataclass fields must be a sequence");
+    Py_DECREF(fields);
+    if(fast == NULL) {
+        return 1;
+    }
+
+    // slot offsets are only safe to use when attribute access isn't customised
+    bool generic = type->tp_getattro == PyObject_GenericGetAttr;
+    for(Py_ssize_t index = 0; index < PySequence_Fast_GET_SIZE(fast); ++index) {
+        field_plan field;
+        field.offset = -1;
+        field.name = PyObject_GetAttrString(PySequence_Fast_GET_ITEM(fast, index), "name");
+        if(field.name == NULL) {
+            Py_DECREF(fast);
+            return 1;
         }
-        else {
-            bytes[2] = 0;
-            value = integer;
+        PyUnicode_InternInPlace(&field.name);
+        plan->fields.push_back(field);
+
+        if(plan_atom(plan->fields.back().key, field.name)) {
+            Py_DECREF(fast);
+            return 1;
+        }
+
+        PyObject* descr = generic ? _PyType_Lookup(type, field.name) : NULL;
+        if(descr != NULL && Py_TYPE(descr) == &PyMemberDescr_Type) {
+            PyMemberDef* member = reinterpret_cast<PyMemberDescrObject*>(descr)->d_member;
+            if(member->type == T_OBJECT_EX) {
+                plan->fields.back().offset = member->offset;
+            }
         }
-        pack_long_long(bytes, value);
-        buffer.append(reinterpret_cast<const char*>(bytes), 3 + bytes[1]);
     }
+    Py_DECREF(fast);
+    plan->kind = plan_kind::dataclass;
+    return 0;
+}
 
-    void append_double(double f) {
-        unsigned char bytes[9]; // 1 + sizeof(double)
-        bytes[0] = FLOAT_IEEE_EXT;
-        uint64_t as_number;
-        memcpy(&as_number, &f, sizeof(as_number));
-        as_big_endian64(bytes + 1, as_number);
-        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+static int plan_namedtuple(PyTypeObject* type, type_plan* plan) {
+    plan->kind = plan_kind::namedtuple;
+    PyObject* name = PyObject_GetAttrString(reinterpret_cast<PyObject*>(type), "__name__");
+    if(name == NULL) {
+        return 1;
     }
 
-    void append_atom(const char* bytes, uint16_t size) {
-        if(size < 255) {
-            buffer.push_back(SMALL_ATOM_EXT);
-            buffer.push_back(static_cast<unsigned char>(size));
-            buffer.append(bytes, size);
-            return;
+    int ret = plan_atom(plan->tag, name);
+    Py_DECREF(name);
+    return ret;
+}
+
+static int is_enum_class(PyTypeObject* type) {
+    PyObject* enum_module = PyImport_ImportModule("enum");
+    if(enum_module == NULL) {
+        return -1;
+    }
+
+    PyObject* base = PyObject_GetAttrString(enum_module, "Enum");
+    Py_DECREF(enum_module);
+    if(base == NULL) {
+        return -1;
+    }
+
+    int ret = PyObject_IsSubclass(reinterpret_cast<PyObject*>(type), base);
+    Py_DECREF(base);
+    return ret;
+}
+
+static type_plan* make_type_plan(PyTypeObject* type) {
+    PyObject* cls = reinterpret_cast<PyObject*>(type);
+    type_plan* plan = new type_plan();
+    int ret = 0;
+
+    int is_enum = is_enum_class(type);
+    if(is_enum < 0) {
+        ret = 1;
+    }
+    else if(is_enum) {
+        plan->kind = plan_kind::enumeration;
+    }
+    else if(PyObject_HasAttrString(cls, "__dataclass_fields__")) {
+        ret = plan_dataclass(type, plan);
+    }
+    else if(PyType_IsSubtype(type, &PyTuple_Type) && PyObject_HasAttrString(cls, "_fields")) {
+        ret = plan_namedtuple(type, plan);
+    }
+    else if(!is_builtin_subtype(type)) {
+        int is_mapping = is_mapping_class(type);
+        if(is_mapping < 0) {
+            ret = 1;
         }
+        else if(is_mapping) {
+            plan->kind = plan_kind::mapping;
+        }
+        else if(type->tp_iter != NULL) {
+            plan->kind = plan_kind::iterable;
+        }
+    }
 
-        unsigned char buf[3];
-        buf[0] = ATOM_EXT;
-        as_big_endian16(buf + 1, size);
-        buffer.append(reinterpret_cast<const char*>(buf), sizeof(buf));
-        buffer.append(bytes, size);
+    if(ret) {
+        delete plan;
+        return NULL;
     }
+    return plan;
+}
 
-    void append_binary(const char* bytes, uint32_t size) {
-        unsigned char buf[5];
-        buf[0] = BINARY_EXT;
-        as_big_endian32(buf + 1, size);
-        buffer.append(reinterpret_cast<const char*>(buf), sizeof(buf));
-        buffer.append(bytes, size);
+static PyObject* type_plan_forget(PyObject* self, PyObject* ref) {
+    if(PyDict_DelItem(type_plans, ref) < 0) {
+        PyErr_Clear();
     }
+    Py_RETURN_NONE;
+}
 
-    void append_string(const char* bytes, uint16_t size) {
-        unsigned char buf[3];
-        buf[0] = STRING_EXT;
-        as_big_endian16(buf + 1, size);
-        buffer.append(reinterpret_cast<const char*>(buf), sizeof(buf));
-        buffer.append(bytes, size);
+static PyMethodDef type_plan_forget_def = {"_forget_type_plan", type_plan_forget, METH_O, NULL};
+
+static type_plan* find_type_plan(PyTypeObject* type) {
+    // a type's weak reference without a callback is shared, so the lookup doesn't allocate.
+    // it compares equal to the key while the type is alive
+    PyObject* ref = PyWeakref_NewRef(reinterpret_cast<PyObject*>(type), NULL);
+    if(ref == NULL) {
+        return NULL;
     }
 
-    void append_nil_ext() {
-        buffer.push_back(NIL_EXT);
+    PyObject* capsule = PyDict_GetItemWithError(type_plans, ref);
+    Py_DECREF(ref);
+    if(capsule != NULL) {
+        return reinterpret_cast<type_plan*>(PyCapsule_GetPointer(capsule, "earl.type_plan"));
     }
 
-    void append_list_header(uint32_t size) {
-        unsigned char bytes[5];
-        bytes[0] = LIST_EXT;
-        as_big_endian32(bytes + 1, size);
-        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    if(PyErr_Occurred()) {
+        return NULL;
     }
 
-    void append_map_header(uint32_t size) {
-        unsigned char bytes[5];
-        bytes[0] = MAP_EXT;
-        as_big_endian32(bytes + 1, size);
-        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    type_plan* plan = make_type_plan(type);
+    if(plan == NULL) {
+        return NULL;
     }
 
-    void append_tuple_header(uint32_t size) {
-        if(size < 256) {
-            buffer.push_back(SMALL_TUPLE_EXT);
-            buffer.push_back(size);
-        }
-        else {
-            unsigned char bytes[5];
-            bytes[0] = LARGE_TUPLE_EXT;
-            as_big_endian32(bytes + 1, size);
-            buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
-        }
+    capsule = PyCapsule_New(plan, "earl.type_plan", type_plan_destructor);
+    if(capsule == NULL) {
+        delete plan;
+        return NULL;
     }
 
-    void pack_long_long(unsigned char* bytes, uint64_t value) {
-        uint8_t bytes_encoded = 0;
-        bytes[0] = SMALL_BIG_EXT;
-        while(value > 0) {
-            bytes[3 + bytes_encoded] = value & 0xFF;
-            value >>= 8;
-            ++bytes_encoded;
-        }
-        bytes[1] = bytes_encoded;
+    ref = PyWeakref_NewRef(reinterpret_cast<PyObject*>(type), forget_type_plan);
+    if(ref == NULL) {
+        Py_DECREF(capsule);
+        return NULL;
     }
 
-    int unicode_as_atom(PyObject* str) {
-        PyObject* bytes = PyUnicode_AsUTF8String(str);
-        if(bytes == NULL || PyErr_Occurred()) {
-            Py_XDECREF(bytes);
-            return 1;
+    int ret = PyDict_SetItem(type_plans, ref, capsule);
+    Py_DECREF(ref);
+    Py_DECREF(capsule); // the dict keeps the plan alive
+    return ret < 0 ? NULL : plan;
+}
+
+// where a streaming packer sends its bytes. the base class only counts them.
+struct sink {
+    sink(): total(0) {}
+    virtual ~sink() {}
+
+    // returns 1 on error
+    virtual int write(const char* data, Py_ssize_t size) {
+        total += size;
+        return 0;
+    }
+
+    // called for large binaries, which a sink may keep a reference to instead of copying.
+    // owner is the object the bytes belong to, or NULL when they are temporary
+    virtual int reference(PyObject* owner, const char* data, Py_ssize_t size) {
+        return write(data, size);
+    }
+
+    // called once everything has been written
+    virtual int finish() {
+        return 0;
+    }
+
+    Py_ssize_t total;
+};
+
+struct fd_sink : sink {
+    fd_sink(int fd): fd(fd) {}
+
+    int write(const char* data, Py_ssize_t size) {
+        total += size;
+        while(size > 0) {
+            Py_ssize_t written;
+            Py_BEGIN_ALLOW_THREADS
+#ifdef _WIN32
+            written = _write(fd, data, static_cast<unsigned int>(std::min<Py_ssize_t>(size, INT32_MAX)));
+#else
+            written = ::write(fd, data, size);
+#endif
+            Py_END_ALLOW_THREADS
+
+            if(written < 0) {
+                if(errno == EINTR) {
+                    if(PyErr_CheckSignals()) {
+                        return 1;
+                    }
+                    continue;
+                }
+                PyErr_SetFromErrno(PyExc_OSError);
+                return 1;
+            }
+            data += written;
+            size -= written;
         }
+        return 0;
+    }
 
-        Py_ssize_t len = PyBytes_GET_SIZE(bytes);
-        if(len > UINT16_MAX) {
-            PyErr_SetString(earl_EncodeError, "string too big to encoded as ATOM_EXT");
-            Py_DECREF(bytes);
+    int fd;
+};
+
+// anything with a write() method, such as a file, socket.makefile() or BytesIO
+struct writer_sink : sink {
+    writer_sink(PyObject* write_method, bool raw): write_method(write_method), raw(raw) {}
+
+    int write(const char* data, Py_ssize_t size) {
+        PyObject* chunk = PyBytes_FromStringAndSize(data, size);
+        if(chunk == NULL) {
             return 1;
         }
 
-        append_atom(PyBytes_AS_STRING(bytes), len);
-        return 0;
+        int ret = write_object(chunk, size);
+        Py_DECREF(chunk);
+        return ret;
     }
 
-    int pack_object(PyObject* obj) {
-        if(obj == Py_None) {
-            append_nil();
-            return 0;
+    // large binaries go to write() as the object itself or a view of it, never a copy
+    int reference(PyObject* owner, const char* data, Py_ssize_t size) {
+        if(owner == NULL) {
+            return write(data, size);
         }
-        else if(obj == Py_False) {
-            append_false();
-            return 0;
+
+        if(PyBytes_CheckExact(owner) && PyBytes_AS_STRING(owner) == data && PyBytes_GET_SIZE(owner) == size) {
+            return write_object(owner, size);
         }
-        else if(obj == Py_True) {
-            append_true();
-            return 0;
-        }
-        else if(PyLong_Check(obj)) {
-            int overflow;
-            long long ret = PyLong_AsLongLongAndOverflow(obj, &overflow);
-            if(ret == -1 && PyErr_Occurred()) {
-                return 1;
-            }
-
-            if(overflow == 0) {
-                // no overflow, fits perfectly in a long long so..
-                if(ret >= 0 && ret <= UINT8_MAX) {
-                    append_small_integer(ret);
-                }
-                else if(ret >= INT32_MIN && ret <= INT32_MAX) {
-                    append_integer(ret);
-                }
-                else {
-                    append_int64_t(ret);
-                }
-                return 0;
-            }
 
-            if(overflow == -1) {
-                // too small for a long long means it's too small for us
-                PyErr_SetString(earl_EncodeError, "Integer value to pack is too small.");
-                return 1;
-            }
-
-            // if overflow is 1 then it could *potentially* fit in an unsigned long long
-            unsigned long long other = PyLong_AsUnsignedLongLong(obj);
-            if(PyErr_Occurred()) {
-                return 1;
-            }
-            append_uint64_t(other);
-            return 0;
+        PyObject* view = PyMemoryView_FromObject(owner);
+        if(view == NULL) {
+            return 1;
         }
-        else if(PyFloat_Check(obj)) {
-            append_double(PyFloat_AS_DOUBLE(obj));
-            return 0;
+
+        // as bytes, whatever the format of the buffer
+        PyObject* raw_view = PyObject_CallMethod(view, "cast", "s", "B");
+        Py_DECREF(view);
+        if(raw_view == NULL) {
+            return 1;
         }
-        else if(PyUnicode_Check(obj)) {
-            if(encode_mode == encode_type::atom) {
-                return unicode_as_atom(obj);
-            }
 
-            PyObject* bytes_obj = PyUnicode_AsEncodedString(obj, encoding, NULL);
-            if(PyErr_Occurred()) {
-                Py_XDECREF(bytes_obj);
-                return 1;
-            }
-            Py_ssize_t byte_size = PyBytes_GET_SIZE(bytes_obj);
-            if(encode_mode == encode_type::str) {
-                if(byte_size > UINT16_MAX) {
-                    PyErr_SetString(earl_EncodeError, "str is too big to be encoded as STRING_EXT");
-                    Py_DECREF(bytes_obj);
-                    return 1;
-                }
-                append_string(PyBytes_AS_STRING(bytes_obj), byte_size);
-            }
-            else {
-                if(byte_size > INT32_MAX) {
-                    PyErr_SetString(earl_EncodeError, "str is too big to be encoded as BINARY_EXT");
-                    Py_DECREF(bytes_obj);
-                    return 1;
-                }
-                append_binary(PyBytes_AS_STRING(bytes_obj), byte_size);
-            }
-            Py_DECREF(bytes_obj); // we don't need you any longer
-            return 0;
+        Py_ssize_t start = data - reinterpret_cast<const char*>(PyMemoryView_GET_BUFFER(raw_view)->buf);
+        PyObject* slice = PySequence_GetSlice(raw_view, start, start + size);
+        Py_DECREF(raw_view);
+        if(slice == NULL) {
+            return 1;
         }
-        else if(PyTuple_Check(obj)) {
-            Py_ssize_t tuple_size = PyTuple_GET_SIZE(obj);
-            if(tuple_size > INT32_MAX) {
-                PyErr_SetString(earl_EncodeError, "tuple has too many elements");
+
+        int ret = write_object(slice, size);
+        Py_DECREF(slice);
+        return ret;
+    }
+
+    // hands size bytes of chunk to write(), following a short write with a view of the rest
+    int write_object(PyObject* chunk, Py_ssize_t size) {
+        total += size;
+        Py_INCREF(chunk);
+        while(size > 0) {
+            PyObject* ret = PyObject_CallFunctionObjArgs(write_method, chunk, NULL);
+            if(ret == NULL) {
+                Py_DECREF(chunk);
                 return 1;
             }
-            append_tuple_header(tuple_size);
-            for(Py_ssize_t index = 0; index < tuple_size; ++index) {
-                if(pack_object(PyTuple_GET_ITEM(obj, index))) {
-                    return 1;
-                }
+
+            // raw streams may take less than we gave them, or nothing at all when non-blocking.
+            // everything else takes it all
+            Py_ssize_t written = size;
+            if(PyLong_Check(ret)) {
+                written = PyLong_AsSsize_t(ret);
             }
-            return 0;
-        }
-        else if(PyList_Check(obj)) {
-            Py_ssize_t list_size = PyList_GET_SIZE(obj);
-            if(list_size > INT32_MAX) {
-                PyErr_SetString(earl_EncodeError, "list has too many elements");
+            else if(raw && ret == Py_None) {
+                Py_DECREF(ret);
+                Py_DECREF(chunk);
+                PyErr_SetString(PyExc_BlockingIOError, "write() would block, pack_to needs a blocking stream");
                 return 1;
             }
-            if(list_size == 0) {
-                append_nil_ext();
-                return 0;
-            }
+            Py_DECREF(ret);
 
-            append_list_header(list_size);
-            for(Py_ssize_t index = 0; index < list_size; ++index) {
-                if(pack_object(PyList_GET_ITEM(obj, index))) {
-                    return 1;
+            if(written < 0 || written > size) {
+                if(!PyErr_Occurred()) {
+                    PyErr_SetString(PyExc_OSError, "write() returned an invalid length");
                 }
-            }
-            append_nil_ext();
-            return 0;
-        }
-        else if(PyDict_Check(obj)) {
-            Py_ssize_t dict_size = PyDict_Size(obj);
-            if(dict_size > INT32_MAX) {
-                PyErr_SetString(earl_EncodeError, "dict has too many elements");
+                Py_DECREF(chunk);
                 return 1;
             }
 
-            append_map_header(dict_size);
-            PyObject* key;
-            PyObject* value;
-            Py_ssize_t pos = 0;
-            while(PyDict_Next(obj, &pos, &key, &value)) {
-                if(pack_object(key) || pack_object(value)) {
+            size -= written;
+            if(size > 0) {
+                PyObject* view = PyMemoryView_Check(chunk) ? chunk : PyMemoryView_FromObject(chunk);
+                if(view == chunk) {
+                    Py_INCREF(view);
+                }
+                PyObject* rest = view != NULL ? PySequence_GetSlice(view, written, written + size) : NULL;
+                Py_XDECREF(view);
+                Py_DECREF(chunk);
+                if(rest == NULL) {
                     return 1;
                 }
+                chunk = rest;
             }
-            return 0;
-        }
-        else if(PyBytes_Check(obj)) {
-            append_binary(PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
-            return 0;
-        }
-        else if(PyByteArray_Check(obj)) {
-            append_binary(PyByteArray_AS_STRING(obj), PyByteArray_GET_SIZE(obj));
-            return 0;
-        }
-        else {
-            PyErr_SetString(earl_EncodeError, "unable to encode object");
-            return 1;
         }
+        Py_DECREF(chunk);
+        return 0;
     }
+
+    PyObject* write_method;
+    bool raw;               // an io.RawIOBase, for which None means nothing was written
 };
 
-// this is an unrolled version of unpacker::get() seen below
-#define EARL_GET_UNROLLED(name) \
-    if(offset > buf.len) { \
-        return PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd)", offset, buf.len); \
-    } \
-    uint8_t name = bytes[offset++]
+// returns -1 on error
+static int is_raw_stream(PyObject* writer) {
+    PyObject* io = PyImport_ImportModule("io");
+    if(io == NULL) {
+        return -1;
+    }
 
-// a macro that gives a uint32_t length for use of the unpacker
-// also handles the return NULL case.
-#define EARL_GET_LENGTH \
-    const char* len = range(4); \
-    if(len == NULL) { \
-        return NULL; \
-    } \
-    uint32_t length = from_big_endian<uint32_t>(len);
+    PyObject* base = PyObject_GetAttrString(io, "RawIOBase");
+    Py_DECREF(io);
+    if(base == NULL) {
+        return -1;
+    }
 
-struct unpacker {
-    unpacker(Py_buffer buf, const char* encoding, bool encode_binary_ext):
-        buf(buf), bytes(reinterpret_cast<const char*>(buf.buf)),
-        encoding(encoding), offset(0), encode_binary_ext(encode_binary_ext) {}
+    int ret = PyObject_IsInstance(writer, base);
+    Py_DECREF(base);
+    return ret;
+}
+
+// compresses everything with zlib before handing it to another sink
+struct zlib_sink : sink {
+    zlib_sink(sink* out): out(out), compressor(NULL) {}
+
+    ~zlib_sink() {
+        Py_XDECREF(compressor);
+    }
+
+    int start(int level) {
+        PyObject* zlib = PyImport_ImportModule("zlib");
+        if(zlib == NULL) {
+            return 1;
+        }
+
+        compressor = PyObject_CallMethod(zlib, "compressobj", "i", level);
+        Py_DECREF(zlib);
+        return compressor == NULL;
+    }
 
-    PyObject* unpack() {
-        char version = bytes[offset++];
-        if(version != FORMAT_VERSION) {
-            return PyErr_Format(earl_DecodeError, "Bad version. Expected '\\x%x', found '\\x%x' instead", FORMAT_VERSION & 0xFF, version);
+    int write(const char* data, Py_ssize_t size) {
+        total += size;
+        PyObject* view = PyMemoryView_FromMemory(const_cast<char*>(data), size, PyBUF_READ);
+        if(view == NULL) {
+            return 1;
         }
 
-        return decode();
+        PyObject* compressed = PyObject_CallMethod(compressor, "compress", "O", view);
+        Py_DECREF(view);
+        return forward(compressed);
     }
 
-    ~unpacker() {
-        PyBuffer_Release(&buf);
+    int finish() {
+        return forward(PyObject_CallMethod(compressor, "flush", NULL)) || out->finish();
     }
+
 private:
-    Py_buffer buf;
-    const char* bytes;
-    const char* encoding;
-    Py_ssize_t offset;
-    bool encode_binary_ext;
+    sink* out;
+    PyObject* compressor;
 
-    const char* get() {
-        if(offset > buf.len) {
-            PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd)", offset, buf.len);
-            return NULL;
+    int forward(PyObject* compressed) {
+        if(compressed == NULL) {
+            return 1;
         }
-        return &bytes[offset++];
+
+        int ret = out->write(PyBytes_AS_STRING(compressed), PyBytes_GET_SIZE(compressed));
+        Py_DECREF(compressed);
+        return ret;
     }
+};
 
-    const char* range(Py_ssize_t count) {
-        if(offset + count > buf.len) {
-            PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd, count: %zd)", offset, buf.len, count);
-            return NULL;
+// collects the packed term as a list of buffers for socket.sendmsg or os.writev
+struct iov_sink : sink {
+    iov_sink(PyObject* segments): segments(segments) {}
+
+    int write(const char* data, Py_ssize_t size) {
+        total += size;
+        PyObject* chunk = PyBytes_FromStringAndSize(data, size);
+        return append(chunk);
+    }
+
+    int reference(PyObject* owner, const char* data, Py_ssize_t size) {
+        if(owner == NULL) {
+            return write(data, size);
         }
-        const char* copy = bytes + offset;
-        offset += count;
-        return copy;
+
+        total += size;
+        if(PyBytes_CheckExact(owner)) {
+            Py_INCREF(owner);
+            return append(owner);
+        }
+        return append(PyMemoryView_FromObject(owner));
     }
 
-    PyObject* decode() {
-        EARL_GET_UNROLLED(op);
-        switch(op) {
-        case SMALL_INTEGER_EXT:
-            return small_int_ext();
-        case INTEGER_EXT:
-            return integer_ext();
-        case FLOAT_IEEE_EXT:
-            return float_ieee();
-        case SMALL_BIG_EXT:
-            return small_big_int();
-        case ATOM_EXT:
-            return atom_ext();
-        case SMALL_ATOM_EXT:
-            return small_atom_ext();
-        case NIL_EXT:
-            return nil_ext();
-        case SMALL_TUPLE_EXT:
-            return small_tuple_ext();
-        case LARGE_TUPLE_EXT:
-            return large_tuple_ext();
-        case LIST_EXT:
-            return list_ext();
-        case STRING_EXT:
-            return string_ext();
-        case BINARY_EXT:
-            return binary_ext();
-        case MAP_EXT:
-            return map_ext();
-        case COMPRESSED_TERM:
-            return compressed();
-        default:
-            return PyErr_Format(earl_DecodeError, "Unexpected opcode: '\\x%x'", op);
+private:
+    PyObject* segments;
+
+    int append(PyObject* segment) {
+        if(segment == NULL) {
+            return 1;
         }
+
+        int ret = PyList_Append(segments, segment);
+        Py_DECREF(segment);
+        return ret < 0;
     }
+};
 
-    PyObject* small_int_ext() {
-        const char* byte = get();
-        return byte ? PyLong_FromUnsignedLong(static_cast<unsigned char>(*byte)) : NULL;
+// XXH64, fed as the packed bytes become final so the digest needs no pass of its own
+struct xxh64 {
+    xxh64(): length(0), buffered(0) {
+        lanes[0] = PRIME1 + PRIME2;
+        lanes[1] = PRIME2;
+        lanes[2] = 0;
+        lanes[3] = 0 - PRIME1;
     }
 
-    PyObject* integer_ext() {
-        const char* ret = range(4);
-        if(ret == NULL) {
-            return NULL;
+    void update(const char* data, size_t size) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        length += size;
+        if(buffered + size < 32) {
+            memcpy(pending + buffered, p, size);
+            buffered += size;
+            return;
         }
-        int32_t x = 0;
-#if PY_BIG_ENDIAN
-        memcpy(&x, value, length);
-#else
-        char buf[4]; // enough to fill our bytes
-        char* end = &buf[3];
-        for(Py_ssize_t i = 0; i < 4; ++i) {
-            *end-- = *ret++;
+
+        if(buffered) {
+            size_t fill = 32 - buffered;
+            memcpy(pending + buffered, p, fill);
+            stripe(pending);
+            p += fill;
+            size -= fill;
+            buffered = 0;
         }
-        memcpy(&x, buf, 4);
-#endif // endian check
-        return PyLong_FromLong(x);
+
+        for(; size >= 32; p += 32, size -= 32) {
+            stripe(p);
+        }
+        memcpy(pending, p, size);
+        buffered = size;
     }
 
-    PyObject* small_big_int() {
-        EARL_GET_UNROLLED(length);
-        const char* e = range(length + 1);
-        if(e == NULL) {
-            return NULL;
+    uint64_t digest() const {
+        uint64_t hash;
+        if(length >= 32) {
+            hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+            for(int i = 0; i < 4; ++i) {
+                hash = (hash ^ mix(0, lanes[i])) * PRIME1 + PRIME4;
+            }
+        }
+        else {
+            hash = lanes[2] + PRIME5;
         }
+        hash += length;
 
-        if(length > 8) {
-            return PyErr_Format(earl_DecodeError, "big integer too big to unpack, expected up to 8 bytes"
-                                                  " but received %d bytes instead", length);
+        const unsigned char* p = pending;
+        size_t size = buffered;
+        for(; size >= 8; p += 8, size -= 8) {
+            hash = rotl(hash ^ mix(0, read64(p)), 27) * PRIME1 + PRIME4;
+        }
+        if(size >= 4) {
+            hash = rotl(hash ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+            size -= 4;
+        }
+        for(; size > 0; ++p, --size) {
+            hash = rotl(hash ^ (*p * PRIME5), 11) * PRIME1;
         }
 
-        return convert_big_integer(e, length);
+        hash ^= hash >> 33;
+        hash *= PRIME2;
+        hash ^= hash >> 29;
+        hash *= PRIME3;
+        hash ^= hash >> 32;
+        return hash;
     }
+private:
+    static const uint64_t PRIME1 = 11400714785074694791ULL;
+    static const uint64_t PRIME2 = 14029467366897019727ULL;
+    static const uint64_t PRIME3 = 1609587929392839161ULL;
+    static const uint64_t PRIME4 = 9650029242287828579ULL;
+    static const uint64_t PRIME5 = 2870177450012600261ULL;
 
-    PyObject* convert_big_integer(const char* value, Py_ssize_t length) {
-        // length does not contain the sign bit but value does
-        uint8_t sign = *value++;
+    uint64_t lanes[4];
+    uint64_t length;
+    unsigned char pending[32];
+    size_t buffered;
 
-        // the easy ULL case
-        if(sign == 0) {
-            uint64_t ret = 0;
-#if PY_BIG_ENDIAN
-            char buf[8]; // enough to fill our bytes
-            char* end = &buf[length - 1];
-            for(Py_ssize_t i = 0; i < length; ++i) {
-                *end-- = *value++;
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t value = 0;
+        for(int i = 7; i >= 0; --i) {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+
+    static uint64_t read32(const unsigned char* p) {
+        return static_cast<uint64_t>(p[0]) | static_cast<uint64_t>(p[1]) << 8 |
+               static_cast<uint64_t>(p[2]) << 16 | static_cast<uint64_t>(p[3]) << 24;
+    }
+
+    static uint64_t mix(uint64_t lane, uint64_t input) {
+        return rotl(lane + input * PRIME2, 31) * PRIME1;
+    }
+
+    void stripe(const unsigned char* p) {
+        for(int i = 0; i < 4; ++i) {
+            lanes[i] = mix(lanes[i], read64(p + 8 * i));
+        }
+    }
+};
+
+// Erlang term order over terms we packed ourselves, used to sort maps and sets when
+// packing deterministically. numbers < atoms < tuples < maps < nil < lists < binaries,
+// and as in map key order, integers sort before floats.
+struct term_order {
+    static int compare(const unsigned char* a, const unsigned char* b) {
+        int rank_a = rank(a);
+        int rank_b = rank(b);
+        if(rank_a != rank_b) {
+            return rank_a < rank_b ? -1 : 1;
+        }
+
+        switch(rank_a) {
+        case 0:
+            return compare_numbers(a, b);
+        case 1:
+        case 6: {
+            size_t size_a, size_b;
+            const unsigned char* text_a = text(a, size_a);
+            const unsigned char* text_b = text(b, size_b);
+            int ret = memcmp(text_a, text_b, std::min(size_a, size_b));
+            if(ret != 0) {
+                return ret < 0 ? -1 : 1;
             }
-            memcpy(&ret, buf, length);
-#else
-            memcpy(&ret, value, length);
-#endif // endian check
-            return PyLong_FromUnsignedLongLong(ret);
+            return size_a == size_b ? 0 : (size_a < size_b ? -1 : 1);
+        }
+        case 2: {
+            uint32_t arity_a = a[0] == SMALL_TUPLE_EXT ? a[1] : read32(a + 1);
+            uint32_t arity_b = b[0] == SMALL_TUPLE_EXT ? b[1] : read32(b + 1);
+            if(arity_a != arity_b) {
+                return arity_a < arity_b ? -1 : 1;
+            }
+            a += a[0] == SMALL_TUPLE_EXT ? 2 : 5;
+            b += b[0] == SMALL_TUPLE_EXT ? 2 : 5;
+            for(uint32_t i = 0; i < arity_a; ++i) {
+                int ret = compare(a, b);
+                if(ret != 0) {
+                    return ret;
+                }
+                a = skip(a);
+                b = skip(b);
+            }
+            return 0;
         }
+        case 3:
+            return compare_maps(a, b);
+        case 4:
+            return 0;
+        default:
+            return compare_lists(a, b);
+        }
+    }
 
-        uint64_t val = 0;
-        uint64_t b = 1;
-        for(Py_ssize_t i = 0; i < length; ++i) {
-            val += static_cast<unsigned char>(*value) * b;
-            b <<= 8;
-            ++value;
+    // returns the end of the term starting at p
+    static const unsigned char* skip(const unsigned char* p) {
+        switch(p[0]) {
+        case SMALL_INTEGER_EXT:
+            return p + 2;
+        case INTEGER_EXT:
+            return p + 5;
+        case FLOAT_IEEE_EXT:
+            return p + 9;
+        case SMALL_BIG_EXT:
+            return p + 3 + p[1];
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+            return p + 2 + p[1];
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+            return p + 3 + (p[1] << 8 | p[2]);
+        case STRING_EXT:
+            return p + 3 + (p[1] << 8 | p[2]);
+        case BINARY_EXT:
+            return p + 5 + read32(p + 1);
+        case NIL_EXT:
+            return p + 1;
+        case SMALL_TUPLE_EXT:
+        case LARGE_TUPLE_EXT:
+        case MAP_EXT:
+        case LIST_EXT: {
+            uint32_t count = p[0] == SMALL_TUPLE_EXT ? p[1] : read32(p + 1);
+            uint64_t terms = p[0] == MAP_EXT ? 2ULL * count : count + (p[0] == LIST_EXT);
+            p += p[0] == SMALL_TUPLE_EXT ? 2 : 5;
+            for(uint64_t i = 0; i < terms; ++i) {
+                p = skip(p);
+            }
+            return p;
+        }
         }
+        return p + 1;
+    }
+private:
+    static uint32_t read32(const unsigned char* p) {
+        return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
 
-        PyObject* ret = PyLong_FromUnsignedLongLong(val);
+    static int rank(const unsigned char* p) {
+        switch(p[0]) {
+        case SMALL_INTEGER_EXT:
+        case INTEGER_EXT:
+        case SMALL_BIG_EXT:
+        case FLOAT_IEEE_EXT:
+            return 0;
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+            return 1;
+        case SMALL_TUPLE_EXT:
+        case LARGE_TUPLE_EXT:
+            return 2;
+        case MAP_EXT:
+            return 3;
+        case NIL_EXT:
+            return 4;
+        case STRING_EXT:
+            return (p[1] | p[2]) ? 5 : 4;
+        case LIST_EXT:
+            return 5;
+        }
+        return 6;
+    }
 
-        // negate if necessary
-        if(sign == 0) {
-            return ret;
+    static const unsigned char* text(const unsigned char* p, size_t& size) {
+        switch(p[0]) {
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+            size = p[1];
+            return p + 2;
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+            size = p[1] << 8 | p[2];
+            return p + 3;
+        }
+        size = read32(p + 1);
+        return p + 5;
+    }
+
+    // integers as a sign and magnitude, which covers everything up to 64 bit SMALL_BIG_EXT
+    static void integer(const unsigned char* p, bool& negative, uint64_t& magnitude) {
+        if(p[0] == SMALL_INTEGER_EXT) {
+            negative = false;
+            magnitude = p[1];
+        }
+        else if(p[0] == INTEGER_EXT) {
+            int32_t value = static_cast<int32_t>(read32(p + 1));
+            negative = value < 0;
+            magnitude = negative ? 0 - static_cast<uint64_t>(static_cast<int64_t>(value)) : value;
         }
         else {
-            PyObject* val = PyNumber_Negative(ret);
-            Py_DECREF(ret);
-            if(val == NULL) {
+            negative = p[2] != 0;
+            magnitude = 0;
+            for(int i = p[1] - 1; i >= 0; --i) {
+                magnitude = (magnitude << 8) | p[3 + i];
+            }
+        }
+    }
+
+    static int compare_numbers(const unsigned char* a, const unsigned char* b) {
+        bool float_a = a[0] == FLOAT_IEEE_EXT;
+        bool float_b = b[0] == FLOAT_IEEE_EXT;
+        if(float_a != float_b) {
+            return float_a ? 1 : -1;
+        }
+
+        if(float_a) {
+            double x, y;
+            uint64_t bits = static_cast<uint64_t>(read32(a + 1)) << 32 | read32(a + 5);
+            memcpy(&x, &bits, sizeof(x));
+            bits = static_cast<uint64_t>(read32(b + 1)) << 32 | read32(b + 5);
+            memcpy(&y, &bits, sizeof(y));
+
+            // NaN goes after every other float so the order stays consistent
+            if(x != x || y != y) {
+                return (x != x) == (y != y) ? 0 : (x != x ? 1 : -1);
+            }
+            return x == y ? 0 : (x < y ? -1 : 1);
+        }
+
+        bool negative_a, negative_b;
+        uint64_t magnitude_a, magnitude_b;
+        integer(a, negative_a, magnitude_a);
+        integer(b, negative_b, magnitude_b);
+        if(negative_a != negative_b) {
+            return negative_a ? -1 : 1;
+        }
+        if(magnitude_a == magnitude_b) {
+            return 0;
+        }
+        return (magnitude_a < magnitude_b) != negative_a ? -1 : 1;
+    }
+
+    // maps of the same size compare their keys in order first, then their values
+    static int compare_maps(const unsigned char* a, const unsigned char* b) {
+        uint32_t size_a = read32(a + 1);
+        uint32_t size_b = read32(b + 1);
+        if(size_a != size_b) {
+            return size_a < size_b ? -1 : 1;
+        }
+
+        for(int values = 0; values < 2; ++values) {
+            const unsigned char* x = a + 5;
+            const unsigned char* y = b + 5;
+            for(uint32_t i = 0; i < size_a; ++i) {
+                if(values) {
+                    x = skip(x);
+                    y = skip(y);
+                }
+
+                int ret = compare(x, y);
+                if(ret != 0) {
+                    return ret;
+                }
+                x = skip(x);
+                y = skip(y);
+                if(!values) {
+                    x = skip(x);
+                    y = skip(y);
+                }
+            }
+        }
+        return 0;
+    }
+
+    // walks the elements of a LIST_EXT or STRING_EXT, the latter as SMALL_INTEGER_EXT
+    struct elements {
+        elements(const unsigned char* p): string(p[0] == STRING_EXT) {
+            remaining = string ? (p[1] << 8 | p[2]) : read32(p + 1);
+            next = p + (string ? 3 : 5);
+            small[0] = SMALL_INTEGER_EXT;
+        }
+
+        const unsigned char* take() {
+            --remaining;
+            if(string) {
+                small[1] = *next++;
+                return small;
+            }
+            const unsigned char* current = next;
+            next = skip(next);
+            return current;
+        }
+
+        bool string;
+        uint32_t remaining;
+        const unsigned char* next;
+        unsigned char small[2];
+    };
+
+    static int compare_lists(const unsigned char* a, const unsigned char* b) {
+        elements x(a);
+        elements y(b);
+        while(x.remaining && y.remaining) {
+            int ret = compare(x.take(), y.take());
+            if(ret != 0) {
+                return ret;
+            }
+        }
+        return x.remaining == y.remaining ? 0 : (x.remaining < y.remaining ? -1 : 1);
+    }
+};
+
+struct packer {
+    packer(const pack_options& options, sink* out = NULL, size_t chunk_size = 0, size_t ref_size = 0):
+        options(options), out(out), chunk_size(chunk_size), ref_size(ref_size), hash(NULL),
+        single_pass(true), envelope(false) {}
+
+    // a chunk_size for sinks that only want the buffer when a reference has to follow it
+    static const size_t no_flush = SIZE_MAX;
+
+    PyObject* pack(PyObject* obj) {
+        buffer.clear();
+        pins.clear();
+        buffer.reserve(1024 * 1024);
+        append_version();
+        if(pack_object(obj)) {
+            // error happened
+            if(PyErr_Occurred()) {
+                return NULL;
+            }
+            else {
+                PyErr_SetString(earl_EncodeError, "An unknown error occurred while packing.");
                 return NULL;
             }
-            return val;
         }
+
+        if(hash != NULL) {
+            hash->update(buffer.data(), buffer.size());
+        }
+        return PyBytes_FromStringAndSize(&buffer[0], buffer.size());
     }
 
-    PyObject* float_ieee() {
-        const char* ret = range(8);
-        if(ret == NULL) {
+    // everything packed from now on also goes through digest
+    void digest_into(xxh64* digest) {
+        hash = digest;
+    }
+
+    // for a first pass that only measures the term, so iterators that would come out
+    // empty the second time are refused before anything is written
+    void expect_second_pass() {
+        single_pass = false;
+    }
+
+    // lets earl.CHUNK through as the placeholder atom pack_chunked looks for
+    void pack_envelope() {
+        envelope = true;
+    }
+
+    // packs the elements of a sequence or mapping into as many terms as it takes to keep
+    // each of them within max_bytes. every term is prefix, a list or map of some of the
+    // elements, then suffix. elements are packed once and cut between, never repacked.
+    // returns a list of bytes objects or NULL on error
+    PyObject* chunked(PyObject* obj, const std::string& prefix, const std::string& suffix, size_t max_bytes) {
+        PyObject* chunks = PyList_New(0);
+        if(chunks == NULL) {
             return NULL;
         }
 
-        double x;
-#if PY_BIG_ENDIAN
-        memcpy(&x, ret, 8);
-#else
-        char buf[8];
-        char* end = &buf[7];
-        for(unsigned i = 0; i < 8; ++i) {
-            *end-- = *ret++;
+        int mapping = is_mapping_class(Py_TYPE(obj));
+        PyObject* items = NULL;
+        if(mapping >= 0) {
+            items = mapping ? PyMapping_Items(obj) : PySequence_Fast(obj, "pack_chunked needs an iterable or a mapping");
         }
-        memcpy(&x, buf, 8);
-#endif // endian check
 
-        return PyFloat_FromDouble(x);
-    }
+        if(items == NULL) {
+            Py_DECREF(chunks);
+            return NULL;
+        }
+
+        // every element is packed up front so that maps and sets can be sorted like any other.
+        // lists keep their order
+        bool unordered = mapping || PyAnySet_Check(obj);
+        std::vector<size_t> starts;
+        int ret = 0;
+        pins.clear();
+        buffer.clear();
+        if(unordered) {
+            begin_entries();
+        }
+        Py_ssize_t size = PySequence_Fast_GET_SIZE(items);
+        for(Py_ssize_t index = 0; !ret && index < size; ++index) {
+            starts.push_back(buffer.size());
+            PyObject* item = PySequence_Fast_GET_ITEM(items, index);
+            if(mapping) {
+                if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+                    PyErr_SetString(earl_EncodeError, "mapping items must be (key, value) pairs");
+                    ret = 1;
+                    break;
+                }
+                ret = pack_object(PyTuple_GET_ITEM(item, 0)) || pack_object(PyTuple_GET_ITEM(item, 1));
+            }
+            else {
+                ret = pack_object(item);
+            }
+        }
+        Py_DECREF(items);
+
+        if(ret) {
+            Py_DECREF(chunks);
+            return NULL;
+        }
+
+        if(unordered) {
+            sort_entries(starts);
+        }
+
+        std::string elements;
+        elements.swap(buffer);
+
+        // what goes after the elements: the list tail and the rest of the envelope
+        size_t closing = (mapping ? 0 : 1) + suffix.size();
+        start_chunk(prefix, mapping);
+
+        uint32_t count = 0;
+        for(size_t index = 0; !ret && index < starts.size(); ++index) {
+            size_t end = index + 1 < starts.size() ? starts[index + 1] : elements.size();
+            size_t length = end - starts[index];
+
+            // carry the element over to a fresh chunk
+            if(count > 0 && buffer.size() + length + closing > max_bytes) {
+                ret = finish_chunk(chunks, prefix.size(), suffix, mapping, count);
+                start_chunk(prefix, mapping);
+                count = 0;
+            }
+
+            if(!ret && buffer.size() + length + closing > max_bytes) {
+                PyErr_Format(earl_EncodeError, "element %zu does not fit in %zu bytes on its own", index, max_bytes);
+                ret = 1;
+            }
+            buffer.append(elements, starts[index], length);
+            ++count;
+        }
+
+        if(ret || finish_chunk(chunks, prefix.size(), suffix, mapping, count)) {
+            Py_DECREF(chunks);
+            return NULL;
+        }
+        return chunks;
+    }
+
+    // lets go of the buffer if one huge term made it grow too much to keep around
+    void trim() {
+        if(buffer.capacity() > 4 * 1024 * 1024) {
+            std::string().swap(buffer);
+        }
+    }
+
+    // packs into the sink, never holding much more than chunk_size bytes at once.
+    // returns 1 on error
+    int stream(PyObject* obj, bool version) {
+        pins.clear();
+        if(chunk_size != no_flush) {
+            buffer.reserve(std::min<size_t>(chunk_size, 1024 * 1024) + 16);
+        }
+        if(version) {
+            append_version();
+        }
+
+        if(pack_object(obj) || flush()) {
+            if(!PyErr_Occurred()) {
+                PyErr_SetString(earl_EncodeError, "An unknown error occurred while packing.");
+            }
+            return 1;
+        }
+        return 0;
+    }
+private:
+    std::string buffer;
+    pack_options options;
+    sink* out;
+    size_t chunk_size;   // flush to the sink once the buffer gets this big, unless no_flush
+    size_t ref_size;     // binaries this big go to the sink without being copied
+    std::vector<size_t> pins; // offsets of list headers and sorted entries that aren't final yet
+    xxh64* hash;
+    bool single_pass;    // false when the term will be packed again, which iterators can't be
+    bool envelope;       // packing a pack_chunked wrap, the only place earl.CHUNK may be
+
+    void start_chunk(const std::string& prefix, bool mapping) {
+        buffer.assign(prefix);
+        if(mapping) {
+            append_map_header(0);
+        }
+        else {
+            append_list_header(0);
+        }
+    }
+
+    // writes the count into the header start_chunk left at offset header and closes the term
+    int finish_chunk(PyObject* chunks, size_t header, const std::string& suffix, bool mapping, uint32_t count) {
+        if(!mapping && count == 0) {
+            buffer.resize(header);
+        }
+        else {
+            as_big_endian32(reinterpret_cast<unsigned char*>(&buffer[header + 1]), count);
+        }
+
+        if(!mapping) {
+            append_nil_ext();
+        }
+        buffer.append(suffix);
+
+        PyObject* chunk = PyBytes_FromStringAndSize(buffer.data(), buffer.size());
+        if(chunk == NULL) {
+            return 1;
+        }
+
+        int ret = PyList_Append(chunks, chunk);
+        Py_DECREF(chunk);
+        return ret < 0;
+    }
+
+    // hands everything before the first pin to the sink
+    int flush() {
+        size_t end = pins.empty() ? buffer.size() : pins.front();
+        if(end == 0) {
+            return 0;
+        }
+
+        if(hash != NULL) {
+            hash->update(buffer.data(), end);
+        }
+        int ret = out->write(buffer.data(), end);
+        buffer.erase(0, end);
+        for(size_t i = 0; i < pins.size(); ++i) {
+            pins[i] -= end;
+        }
+        return ret;
+    }
+
+    void append_version() {
+        buffer.push_back(FORMAT_VERSION);
+    }
+
+    void append_nil() {
+        buffer.push_back(SMALL_ATOM_EXT);
+        buffer.push_back(3);
+        buffer.push_back('n');
+        buffer.push_back('i');
+        buffer.push_back('l');
+    }
+
+    void append_true() {
+        buffer.push_back(SMALL_ATOM_EXT);
+        buffer.push_back(4);
+        buffer.push_back('t');
+        buffer.push_back('r');
+        buffer.push_back('u');
+        buffer.push_back('e');
+    }
+
+    void append_false() {
+        buffer.push_back(SMALL_ATOM_EXT);
+        buffer.push_back(5);
+        buffer.push_back('f');
+        buffer.push_back('a');
+        buffer.push_back('l');
+        buffer.push_back('s');
+        buffer.push_back('e');
+    }
+
+    void append_small_integer(uint8_t integer) {
+        buffer.push_back(SMALL_INTEGER_EXT);
+        buffer.push_back(integer);
+    }
+
+    void append_integer(int32_t integer) {
+        unsigned char bytes[5]; // 1 + sizeof(integer)
+        bytes[0] = INTEGER_EXT;
+        as_big_endian32(bytes + 1, integer);
+        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    }
+
+    void append_uint64_t(uint64_t integer) {
+        unsigned char bytes[11]; // 3 + sizeof(integer)
+        pack_long_long(bytes, integer);
+        bytes[2] = 0;
+        buffer.append(reinterpret_cast<const char*>(bytes), 3 + bytes[1]);
+    }
+
+    void append_int64_t(int64_t integer) {
+        unsigned char bytes[11];
+        uint64_t value;
+        if(integer < 0) {
+            bytes[2] = 1;
+            value = -integer;
+        }
+        else {
+            bytes[2] = 0;
+            value = integer;
+        }
+        pack_long_long(bytes, value);
+        buffer.append(reinterpret_cast<const char*>(bytes), 3 + bytes[1]);
+    }
+
+    void append_double(double f) {
+        unsigned char bytes[9]; // 1 + sizeof(double)
+        bytes[0] = FLOAT_IEEE_EXT;
+        uint64_t as_number;
+        memcpy(&as_number, &f, sizeof(as_number));
+        as_big_endian64(bytes + 1, as_number);
+        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    }
+
+    void append_atom(const char* bytes, uint16_t size) {
+        encode_atom(buffer, bytes, size);
+    }
+
+    void append_binary(const char* bytes, uint32_t size) {
+        unsigned char buf[5];
+        buf[0] = BINARY_EXT;
+        as_big_endian32(buf + 1, size);
+        buffer.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+        buffer.append(bytes, size);
+    }
+
+    void append_string(const char* bytes, uint16_t size) {
+        unsigned char buf[3];
+        buf[0] = STRING_EXT;
+        as_big_endian16(buf + 1, size);
+        buffer.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+        buffer.append(bytes, size);
+    }
+
+    void append_nil_ext() {
+        buffer.push_back(NIL_EXT);
+    }
+
+    void append_list_header(uint32_t size) {
+        unsigned char bytes[5];
+        bytes[0] = LIST_EXT;
+        as_big_endian32(bytes + 1, size);
+        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    }
+
+    void append_map_header(uint32_t size) {
+        unsigned char bytes[5];
+        bytes[0] = MAP_EXT;
+        as_big_endian32(bytes + 1, size);
+        buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    }
+
+    void append_tuple_header(uint32_t size) {
+        if(size < 256) {
+            buffer.push_back(SMALL_TUPLE_EXT);
+            buffer.push_back(size);
+        }
+        else {
+            unsigned char bytes[5];
+            bytes[0] = LARGE_TUPLE_EXT;
+            as_big_endian32(bytes + 1, size);
+            buffer.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+        }
+    }
+
+    void pack_long_long(unsigned char* bytes, uint64_t value) {
+        uint8_t bytes_encoded = 0;
+        bytes[0] = SMALL_BIG_EXT;
+        while(value > 0) {
+            bytes[3 + bytes_encoded] = value & 0xFF;
+            value >>= 8;
+            ++bytes_encoded;
+        }
+        bytes[1] = bytes_encoded;
+    }
+
+    int unicode_as_atom(PyObject* str) {
+        Py_ssize_t len;
+        const char* bytes = PyUnicode_AsUTF8AndSize(str, &len);
+        if(bytes == NULL) {
+            return 1;
+        }
+
+        if(len > UINT16_MAX) {
+            PyErr_SetString(earl_EncodeError, "string too big to encoded as ATOM_EXT");
+            return 1;
+        }
+
+        append_atom(bytes, len);
+        return 0;
+    }
+
+    // returns a new reference to the field's value
+    static PyObject* read_field(PyObject* obj, const field_plan& field) {
+        if(field.offset < 0) {
+            return PyObject_GetAttr(obj, field.name);
+        }
+
+        PyObject* value = *reinterpret_cast<PyObject**>(reinterpret_cast<char*>(obj) + field.offset);
+        if(value == NULL) {
+            PyErr_SetObject(PyExc_AttributeError, field.name);
+            return NULL;
+        }
+        Py_INCREF(value);
+        return value;
+    }
+
+    bool uses_plan(const type_plan& plan) const {
+        // namedtuples are already tuples unless they're being packed as records
+        return plan.kind != plan_kind::none && (plan.kind != plan_kind::namedtuple || options.namedtuple_as_record);
+    }
+
+    // registered records use the same tag they are decoded from. they're looked up every
+    // time since register_record may be called while packing
+    void append_record_tag(PyTypeObject* type, const type_plan& plan) {
+        for(size_t i = 0; i < records.size(); ++i) {
+            if(records[i].factory == reinterpret_cast<PyObject*>(type)) {
+                encode_atom(buffer, records[i].tag.data(), records[i].tag.size());
+                return;
+            }
+        }
+        buffer.append(plan.tag);
+    }
+
+    int pack_planned(PyObject* obj, const type_plan& plan) {
+        if(plan.kind == plan_kind::mapping) {
+            return pack_mapping(obj);
+        }
+
+        if(plan.kind == plan_kind::iterable) {
+            return pack_iterable(obj);
+        }
+
+        if(plan.kind == plan_kind::enumeration) {
+            PyObject* value = PyObject_GetAttrString(obj, options.enum_as_atom ? "_name_" : "_value_");
+            if(value == NULL) {
+                return 1;
+            }
+
+            int ret = options.enum_as_atom ? unicode_as_atom(value) : pack_object(value);
+            Py_DECREF(value);
+            return ret;
+        }
+
+        if(plan.kind == plan_kind::namedtuple) {
+            Py_ssize_t tuple_size = PyTuple_GET_SIZE(obj);
+            if(tuple_size >= INT32_MAX) {
+                PyErr_SetString(earl_EncodeError, "tuple has too many elements");
+                return 1;
+            }
+            append_tuple_header(tuple_size + 1);
+            append_record_tag(Py_TYPE(obj), plan);
+            for(Py_ssize_t index = 0; index < tuple_size; ++index) {
+                if(pack_object(PyTuple_GET_ITEM(obj, index))) {
+                    return 1;
+                }
+            }
+            return 0;
+        }
+
+        std::vector<size_t> starts;
+        append_map_header(plan.fields.size());
+        begin_entries();
+        for(size_t index = 0; index < plan.fields.size(); ++index) {
+            const field_plan& field = plan.fields[index];
+            mark_entry(starts);
+            buffer.append(field.key);
+            PyObject* value = read_field(obj, field);
+            if(value == NULL) {
+                return 1;
+            }
+
+            int ret = pack_object(value);
+            Py_DECREF(value);
+            if(ret) {
+                return 1;
+            }
+        }
+        sort_entries(starts);
+        return 0;
+    }
+
+    // when packing deterministically, map entries and set elements are packed as usual
+    // with their offsets noted down, then reordered by their first term once all are in
+    void begin_entries() {
+        if(options.deterministic) {
+            pins.push_back(buffer.size());
+        }
+    }
+
+    void mark_entry(std::vector<size_t>& starts) {
+        if(options.deterministic) {
+            starts.push_back(buffer.size() - pins.back());
+        }
+    }
+
+    // entries whose first terms tie, like a str and a bytes key that pack the same, or
+    // two NaNs, fall back to their bytes so the order never depends on insertion order
+    struct entry_order {
+        entry_order(const unsigned char* region, size_t length, const std::vector<size_t>& starts):
+            region(region), length(length), starts(starts) {}
+
+        bool operator()(size_t a, size_t b) const {
+            int ret = term_order::compare(region + starts[a], region + starts[b]);
+            if(ret != 0) {
+                return ret < 0;
+            }
+
+            size_t size_a = end(a) - starts[a];
+            size_t size_b = end(b) - starts[b];
+            ret = memcmp(region + starts[a], region + starts[b], std::min(size_a, size_b));
+            return ret != 0 ? ret < 0 : size_a < size_b;
+        }
+
+        size_t end(size_t index) const {
+            return index + 1 < starts.size() ? starts[index + 1] : length;
+        }
+
+        const unsigned char* region;
+        size_t length;
+        const std::vector<size_t>& starts;
+    };
+
+    // starts is left holding the offsets of the entries in their new order
+    void sort_entries(std::vector<size_t>& starts) {
+        if(!options.deterministic) {
+            return;
+        }
+
+        size_t base = pins.back();
+        pins.pop_back();
+        if(starts.size() < 2) {
+            return;
+        }
+
+        std::vector<size_t> order(starts.size());
+        for(size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+
+        size_t length = buffer.size() - base;
+        const unsigned char* region = reinterpret_cast<const unsigned char*>(buffer.data() + base);
+        std::stable_sort(order.begin(), order.end(), entry_order(region, length, starts));
+
+        std::string sorted;
+        std::vector<size_t> sorted_starts(starts.size());
+        sorted.reserve(length);
+        for(size_t i = 0; i < order.size(); ++i) {
+            size_t start = starts[order[i]];
+            size_t end = order[i] + 1 < starts.size() ? starts[order[i] + 1] : length;
+            sorted_starts[i] = sorted.size();
+            sorted.append(buffer, base + start, end - start);
+        }
+        buffer.replace(base, length, sorted);
+        starts.swap(sorted_starts);
+    }
+
+    int pack_mapping(PyObject* obj) {
+        PyObject* items = PyMapping_Items(obj);
+        if(items == NULL) {
+            return 1;
+        }
+
+        Py_ssize_t size = PyList_GET_SIZE(items);
+        if(size > INT32_MAX) {
+            PyErr_SetString(earl_EncodeError, "mapping has too many elements");
+            Py_DECREF(items);
+            return 1;
+        }
+
+        std::vector<size_t> starts;
+        append_map_header(size);
+        begin_entries();
+        for(Py_ssize_t index = 0; index < size; ++index) {
+            PyObject* item = PyList_GET_ITEM(items, index);
+            if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+                PyErr_SetString(earl_EncodeError, "mapping items must be (key, value) pairs");
+                Py_DECREF(items);
+                return 1;
+            }
+
+            mark_entry(starts);
+            if(pack_object(PyTuple_GET_ITEM(item, 0)) || pack_object(PyTuple_GET_ITEM(item, 1))) {
+                Py_DECREF(items);
+                return 1;
+            }
+        }
+        Py_DECREF(items);
+        sort_entries(starts);
+        return 0;
+    }
+
+    // packs everything an iterator yields as a list without collecting it first.
+    // the length isn't known until the end, so it is written over the header afterwards,
+    // and nothing after the header can be flushed until then
+    int pack_iterable(PyObject* obj) {
+        PyObject* iterator = PyObject_GetIter(obj);
+        if(iterator == NULL) {
+            return 1;
+        }
+
+        if(!single_pass && iterator == obj) {
+            Py_DECREF(iterator);
+            PyErr_SetString(earl_EncodeError, "iterators can only be packed once, so they can't be compressed");
+            return 1;
+        }
+
+        pins.push_back(buffer.size());
+        append_list_header(0);
+
+        uint32_t count = 0;
+        int ret = 0;
+        PyObject* item;
+        while(!ret && (item = PyIter_Next(iterator)) != NULL) {
+            if(count == INT32_MAX) {
+                PyErr_SetString(earl_EncodeError, "iterable has too many elements");
+                ret = 1;
+            }
+            else {
+                ret = pack_object(item);
+                ++count;
+            }
+            Py_DECREF(item);
+        }
+        Py_DECREF(iterator);
+
+        size_t header = pins.back();
+        pins.pop_back();
+        if(ret || PyErr_Occurred()) {
+            return 1;
+        }
+
+        if(count == 0) {
+            buffer.resize(header);
+        }
+        else {
+            as_big_endian32(reinterpret_cast<unsigned char*>(&buffer[header + 1]), count);
+        }
+        append_nil_ext();
+        return 0;
+    }
+
+    int pack_set(PyObject* obj) {
+        Py_ssize_t set_size = PySet_GET_SIZE(obj);
+        if(set_size > INT32_MAX) {
+            PyErr_SetString(earl_EncodeError, "set has too many elements");
+            return 1;
+        }
+        if(set_size == 0) {
+            append_nil_ext();
+            return 0;
+        }
+
+        PyObject* iterator = PyObject_GetIter(obj);
+        if(iterator == NULL) {
+            return 1;
+        }
+
+        // the set iterator raises if the set changes size, so the header stays right
+        std::vector<size_t> starts;
+        append_list_header(set_size);
+        begin_entries();
+        PyObject* item;
+        while((item = PyIter_Next(iterator)) != NULL) {
+            mark_entry(starts);
+            int ret = pack_object(item);
+            Py_DECREF(item);
+            if(ret) {
+                Py_DECREF(iterator);
+                return 1;
+            }
+        }
+        Py_DECREF(iterator);
+        if(PyErr_Occurred()) {
+            return 1;
+        }
+        sort_entries(starts);
+        append_nil_ext();
+        return 0;
+    }
+
+    // large binaries skip the buffer entirely when there's a sink.
+    // owner is the object holding the bytes, or NULL if they don't outlive this call
+    int pack_binary(PyObject* owner, const char* bytes, Py_ssize_t size) {
+        if(size > UINT32_MAX) {
+            PyErr_SetString(earl_EncodeError, "binary is too big to be encoded as BINARY_EXT");
+            return 1;
+        }
+
+        // a pinned header is still waiting for its length, so nothing can jump ahead of it
+        if(out == NULL || static_cast<size_t>(size) < ref_size || !pins.empty()) {
+            append_binary(bytes, size);
+            return 0;
+        }
+
+        unsigned char buf[5];
+        buf[0] = BINARY_EXT;
+        as_big_endian32(buf + 1, size);
+        buffer.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+        if(flush()) {
+            return 1;
+        }
+
+        if(hash != NULL) {
+            hash->update(bytes, size);
+        }
+        return out->reference(owner, bytes, size);
+    }
+
+    int pack_object(PyObject* obj) {
+        if(out != NULL && chunk_size != no_flush && buffer.size() >= chunk_size && flush()) {
+            return 1;
+        }
+
+        if(!is_exact_builtin(Py_TYPE(obj))) {
+            if(obj == chunk_marker) {
+                if(!envelope) {
+                    PyErr_SetString(earl_EncodeError, "earl.CHUNK can only be packed in the wrap of pack_chunked");
+                    return 1;
+                }
+                buffer.append(CHUNK_ATOM, sizeof(CHUNK_ATOM) - 1);
+                return 0;
+            }
+
+            type_plan* plan = find_type_plan(Py_TYPE(obj));
+            if(plan == NULL) {
+                return 1;
+            }
+
+            if(uses_plan(*plan)) {
+                return pack_planned(obj, *plan);
+            }
+        }
+
+        if(obj == Py_None) {
+            append_nil();
+            return 0;
+        }
+        else if(obj == Py_False) {
+            append_false();
+            return 0;
+        }
+        else if(obj == Py_True) {
+            append_true();
+            return 0;
+        }
+        else if(PyLong_Check(obj)) {
+            int overflow;
+            long long ret = PyLong_AsLongLongAndOverflow(obj, &overflow);
+            if(ret == -1 && PyErr_Occurred()) {
+                return 1;
+            }
+
+            if(overflow == 0) {
+                // no overflow, fits perfectly in a long long so..
+                if(ret >= 0 && ret <= UINT8_MAX) {
+                    append_small_integer(ret);
+                }
+                else if(ret >= INT32_MIN && ret <= INT32_MAX) {
+                    append_integer(ret);
+                }
+                else {
+                    append_int64_t(ret);
+                }
+                return 0;
+            }
+
+            if(overflow == -1) {
+                // too small for a long long means it's too small for us
+                PyErr_SetString(earl_EncodeError, "Integer value to pack is too small.");
+                return 1;
+            }
+
+            // if overflow is 1 then it could *potentially* fit in an unsigned long long
+            unsigned long long other = PyLong_AsUnsignedLongLong(obj);
+            if(PyErr_Occurred()) {
+                return 1;
+            }
+            append_uint64_t(other);
+            return 0;
+        }
+        else if(PyFloat_Check(obj)) {
+            append_double(PyFloat_AS_DOUBLE(obj));
+            return 0;
+        }
+        else if(PyUnicode_Check(obj)) {
+            if(options.encode_mode == encode_type::atom) {
+                return unicode_as_atom(obj);
+            }
+
+            // UTF-8 is cached inside the str itself, anything else needs a temporary bytes object
+            PyObject* bytes_obj = NULL;
+            const char* byte_data;
+            Py_ssize_t byte_size;
+            if(options.utf8) {
+                byte_data = PyUnicode_AsUTF8AndSize(obj, &byte_size);
+                if(byte_data == NULL) {
+                    return 1;
+                }
+            }
+            else {
+                bytes_obj = PyUnicode_AsEncodedString(obj, options.encoding, NULL);
+                if(bytes_obj == NULL) {
+                    return 1;
+                }
+                byte_data = PyBytes_AS_STRING(bytes_obj);
+                byte_size = PyBytes_GET_SIZE(bytes_obj);
+            }
+
+            if(options.encode_mode == encode_type::str) {
+                if(byte_size > UINT16_MAX) {
+                    PyErr_SetString(earl_EncodeError, "str is too big to be encoded as STRING_EXT");
+                    Py_XDECREF(bytes_obj);
+                    return 1;
+                }
+                append_string(byte_data, byte_size);
+            }
+            else {
+                if(byte_size > INT32_MAX) {
+                    PyErr_SetString(earl_EncodeError, "str is too big to be encoded as BINARY_EXT");
+                    Py_XDECREF(bytes_obj);
+                    return 1;
+                }
+
+                if(pack_binary(bytes_obj, byte_data, byte_size)) {
+                    Py_XDECREF(bytes_obj);
+                    return 1;
+                }
+            }
+            Py_XDECREF(bytes_obj); // we don't need you any longer
+            return 0;
+        }
+        else if(PyTuple_Check(obj)) {
+            Py_ssize_t tuple_size = PyTuple_GET_SIZE(obj);
+            if(tuple_size > INT32_MAX) {
+                PyErr_SetString(earl_EncodeError, "tuple has too many elements");
+                return 1;
+            }
+            append_tuple_header(tuple_size);
+            for(Py_ssize_t index = 0; index < tuple_size; ++index) {
+                if(pack_object(PyTuple_GET_ITEM(obj, index))) {
+                    return 1;
+                }
+            }
+            return 0;
+        }
+        else if(PyList_Check(obj)) {
+            Py_ssize_t list_size = PyList_GET_SIZE(obj);
+            if(list_size > INT32_MAX) {
+                PyErr_SetString(earl_EncodeError, "list has too many elements");
+                return 1;
+            }
+            if(list_size == 0) {
+                append_nil_ext();
+                return 0;
+            }
+
+            append_list_header(list_size);
+            for(Py_ssize_t index = 0; index < list_size; ++index) {
+                if(pack_object(PyList_GET_ITEM(obj, index))) {
+                    return 1;
+                }
+            }
+            append_nil_ext();
+            return 0;
+        }
+        else if(PyDict_Check(obj)) {
+            Py_ssize_t dict_size = PyDict_Size(obj);
+            if(dict_size > INT32_MAX) {
+                PyErr_SetString(earl_EncodeError, "dict has too many elements");
+                return 1;
+            }
+
+            std::vector<size_t> starts;
+            append_map_header(dict_size);
+            begin_entries();
+            PyObject* key;
+            PyObject* value;
+            Py_ssize_t pos = 0;
+            while(PyDict_Next(obj, &pos, &key, &value)) {
+                mark_entry(starts);
+                if(pack_object(key) || pack_object(value)) {
+                    return 1;
+                }
+            }
+            sort_entries(starts);
+            return 0;
+        }
+        else if(PyBytes_Check(obj)) {
+            return pack_binary(obj, PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+        }
+        else if(PyByteArray_Check(obj)) {
+            return pack_binary(obj, PyByteArray_AS_STRING(obj), PyByteArray_GET_SIZE(obj));
+        }
+        else if(PyAnySet_Check(obj)) {
+            return pack_set(obj);
+        }
+        else if(PyMemoryView_Check(obj)) {
+            Py_buffer view;
+            if(PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS) < 0) {
+                return 1;
+            }
+
+            int ret = pack_binary(obj, reinterpret_cast<const char*>(view.buf), view.len);
+            PyBuffer_Release(&view);
+            return ret;
+        }
+        else {
+            PyErr_SetString(earl_EncodeError, "unable to encode object");
+            return 1;
+        }
+    }
+};
+
+struct match_kind {
+    enum {
+        text = 0,
+        binary = 1,
+        atom = 2,
+        integer = 3
+    };
+};
+
+// one step of a peek path, shared between all paths that start the same way
+struct match_step {
+    int kind;
+    std::string bytes;    // UTF-8 text, raw binary or atom name
+    long long integer;    // integer map key or tuple/list position
+    Py_ssize_t slot;      // index in the result tuple if a path ends here, -1 otherwise
+    std::vector<match_step> children;
+
+    bool same_key(const match_step& other) const {
+        return kind == other.kind && integer == other.integer && bytes == other.bytes;
+    }
+};
+
+// a compiled set of paths, walked in a single pass over the ETF bytes
+struct match_plan {
+    match_plan(): slots(0), spans(false) {}
+
+    std::vector<match_step> root;
+    Py_ssize_t slots;
+    bool spans;
+
+    // returns 1 on error
+    int add_path(PyObject* path) {
+        PyObject* steps = NULL;
+        if(PyUnicode_Check(path) || PyBytes_Check(path) || PyLong_Check(path) || path == Py_None) {
+            steps = PyTuple_Pack(1, path);
+        }
+        else {
+            steps = PySequence_Tuple(path);
+        }
+
+        if(steps == NULL) {
+            return 1;
+        }
+
+        Py_ssize_t size = PyTuple_GET_SIZE(steps);
+        if(size == 0) {
+            PyErr_SetString(PyExc_ValueError, "path must have at least one key");
+            Py_DECREF(steps);
+            return 1;
+        }
+
+        std::vector<match_step>* level = &root;
+        match_step* step = NULL;
+        for(Py_ssize_t index = 0; index < size; ++index) {
+            match_step key;
+            if(make_step(PyTuple_GET_ITEM(steps, index), key)) {
+                Py_DECREF(steps);
+                return 1;
+            }
+
+            step = NULL;
+            for(size_t i = 0; i < level->size(); ++i) {
+                if((*level)[i].same_key(key)) {
+                    step = &(*level)[i];
+                    break;
+                }
+            }
+
+            if(step == NULL) {
+                level->push_back(key);
+                step = &level->back();
+            }
+            level = &step->children;
+        }
+        Py_DECREF(steps);
+
+        if(step->slot >= 0) {
+            PyErr_SetString(PyExc_ValueError, "duplicate path");
+            return 1;
+        }
+        step->slot = slots++;
+        return 0;
+    }
+
+private:
+    static int make_step(PyObject* key, match_step& step) {
+        step.slot = -1;
+        step.integer = 0;
+        if(key == Py_None || key == Py_True || key == Py_False) {
+            step.kind = match_kind::atom;
+            step.bytes = key == Py_None ? "nil" : key == Py_True ? "true" : "false";
+        }
+        else if(PyUnicode_Check(key)) {
+            Py_ssize_t size;
+            const char* text = PyUnicode_AsUTF8AndSize(key, &size);
+            if(text == NULL) {
+                return 1;
+            }
+            step.kind = match_kind::text;
+            step.bytes.assign(text, size);
+        }
+        else if(PyBytes_Check(key)) {
+            step.kind = match_kind::binary;
+            step.bytes.assign(PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+        }
+        else if(PyLong_Check(key)) {
+            step.kind = match_kind::integer;
+            step.integer = PyLong_AsLongLong(key);
+            if(step.integer == -1 && PyErr_Occurred()) {
+                return 1;
+            }
+        }
+        else {
+            PyErr_Format(PyExc_TypeError, "path keys must be str, bytes, int, bool or None, not %.200s",
+                         Py_TYPE(key)->tp_name);
+            return 1;
+        }
+        return 0;
+    }
+};
+
+// a bounded map from short byte spans of the input to the objects they decoded to,
+// shared between messages. four way set associative: a new span takes the place of
+// an older one once its bucket is full
+struct span_table {
+    struct entry {
+        entry(): value(NULL) {}
+
+        uint64_t hash;
+        std::string bytes;
+        PyObject* value;
+        Py_hash_t value_hash;   // for key_cache
+        Py_ssize_t value_size;  // for dedupe_table
+    };
+
+    span_table(size_t capacity): entries(0), hits(0), misses(0) {
+        size_t size = WAYS;
+        while(size < capacity) {
+            size <<= 1;
+        }
+        slots.resize(size);
+    }
+
+    ~span_table() {
+        clear();
+    }
+
+    void clear() {
+        for(size_t i = 0; i < slots.size(); ++i) {
+            Py_CLEAR(slots[i].value);
+        }
+        entries = 0;
+    }
+
+    static uint64_t hash_bytes(const char* bytes, size_t size) {
+        xxh64 hasher;
+        hasher.update(bytes, size);
+        return hasher.digest();
+    }
+
+    // counts a hit or a miss, returning the entry on a hit
+    entry* find(const char* bytes, size_t size, uint64_t hash) {
+        entry* bucket = bucket_of(hash);
+        for(size_t i = 0; i < WAYS; ++i) {
+            entry& slot = bucket[i];
+            if(slot.value != NULL && slot.hash == hash && slot.bytes.size() == size &&
+               memcmp(slot.bytes.data(), bytes, size) == 0) {
+                ++hits;
+                return &slot;
+            }
+        }
+        ++misses;
+        return NULL;
+    }
+
+    // takes a new reference to value
+    entry& insert(const char* bytes, size_t size, uint64_t hash, PyObject* value) {
+        entry* bucket = bucket_of(hash);
+        entry* slot = &bucket[misses % WAYS];
+        for(size_t i = 0; i < WAYS; ++i) {
+            if(bucket[i].value == NULL) {
+                slot = &bucket[i];
+                break;
+            }
+        }
+
+        if(slot->value == NULL) {
+            ++entries;
+        }
+        Py_INCREF(value);
+        Py_XDECREF(slot->value);
+        slot->hash = hash;
+        slot->bytes.assign(bytes, size);
+        slot->value = value;
+        return *slot;
+    }
+
+    static const size_t WAYS = 4;
+
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    std::vector<entry> slots;
+private:
+    entry* bucket_of(uint64_t hash) {
+        return &slots[(hash & (slots.size() / WAYS - 1)) * WAYS];
+    }
+};
+
+// decoded map keys, as str with their hash already computed so that repeated
+// keys cost a lookup
+struct key_cache : span_table {
+    key_cache(size_t capacity, size_t max_key_size): span_table(capacity), max_key_size(max_key_size) {}
+
+    // returns a new reference to the UTF-8 decoded key and its hash, or NULL on error
+    PyObject* find(const char* bytes, size_t size, Py_hash_t& hash) {
+        uint64_t key_hash = hash_bytes(bytes, size);
+        entry* found = span_table::find(bytes, size, key_hash);
+        if(found != NULL) {
+            hash = found->value_hash;
+            Py_INCREF(found->value);
+            return found->value;
+        }
+
+        PyObject* value = PyUnicode_DecodeUTF8(bytes, size, "strict");
+        if(value == NULL) {
+            return NULL;
+        }
+
+        // not interned, since interned strings are immortal from 3.12 and evicted keys
+        // have to be freed. sharing the one object already makes the lookups cheap
+        hash = PyObject_Hash(value);
+        if(hash == -1) {
+            Py_DECREF(value);
+            return NULL;
+        }
+
+        insert(bytes, size, key_hash, value).value_hash = hash;
+        return value;
+    }
+
+    size_t max_key_size;
+};
+
+// immutable terms seen while unpacking, so identical encodings share one object
+struct dedupe_table : span_table {
+    dedupe_table(size_t capacity, size_t max_span):
+        span_table(capacity), max_span(max_span), saved(0), bound(false), encode_binary_ext(false) {}
+
+    // the same bytes decode to different objects under other options, so a table sticks to
+    // the ones it was first used with until it is cleared. returns false if they differ
+    bool bind(const unpack_options& options) {
+        std::string name = options.utf8 ? "utf-8" : (options.encoding != NULL ? options.encoding : "");
+        if(!bound) {
+            bound = true;
+            encoding = name;
+            encode_binary_ext = options.encode_binary_ext;
+            return true;
+        }
+        return encoding == name && encode_binary_ext == options.encode_binary_ext;
+    }
+
+    void clear() {
+        span_table::clear();
+        bound = false;
+    }
+
+    size_t max_span;
+    uint64_t saved;     // bytes of objects that didn't have to be created
+    bool bound;
+    std::string encoding;   // empty when STRING_EXT and BINARY_EXT stay bytes
+    bool encode_binary_ext;
+};
+
+// returns the offset of the first byte that isn't part of valid UTF-8, or -1 if there is none.
+// ASCII is checked eight bytes at a time since that is nearly all of what we see
+static Py_ssize_t invalid_utf8(const unsigned char* text, Py_ssize_t size) {
+    Py_ssize_t i = 0;
+    while(i < size) {
+        while(i + 8 <= size) {
+            uint64_t word;
+            memcpy(&word, text + i, sizeof(word));
+            if(word & 0x8080808080808080ULL) {
+                break;
+            }
+            i += 8;
+        }
+
+        if(i == size) {
+            break;
+        }
+
+        unsigned char lead = text[i];
+        if(lead < 0x80) {
+            ++i;
+            continue;
+        }
+
+        // the ranges for the second byte exclude overlong forms, surrogates and anything past U+10FFFF
+        Py_ssize_t length;
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+        if(lead >= 0xC2 && lead <= 0xDF) {
+            length = 2;
+        }
+        else if(lead >= 0xE0 && lead <= 0xEF) {
+            length = 3;
+            low = lead == 0xE0 ? 0xA0 : 0x80;
+            high = lead == 0xED ? 0x9F : 0xBF;
+        }
+        else if(lead >= 0xF0 && lead <= 0xF4) {
+            length = 4;
+            low = lead == 0xF0 ? 0x90 : 0x80;
+            high = lead == 0xF4 ? 0x8F : 0xBF;
+        }
+        else {
+            return i;
+        }
+
+        if(i + 1 >= size || text[i + 1] < low || text[i + 1] > high) {
+            return i;
+        }
+
+        for(Py_ssize_t k = 2; k < length; ++k) {
+            if(i + k >= size || (text[i + k] & 0xC0) != 0x80) {
+                return i;
+            }
+        }
+        i += length;
+    }
+    return -1;
+}
+
+// this is an unrolled version of unpacker::get() seen below
+#define EARL_GET_UNROLLED(name) \
+    if(offset > buf.len) { \
+        return PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd)", offset, buf.len); \
+    } \
+    uint8_t name = bytes[offset++]
+
+// a macro that gives a uint32_t length for use of the unpacker
+// also handles the return NULL case.
+#define EARL_GET_LENGTH \
+    const char* len = range(4); \
+    if(len == NULL) { \
+        return NULL; \
+    } \
+    uint32_t length = from_big_endian<uint32_t>(len);
+
+struct unpacker {
+    unpacker(Py_buffer buf, const unpack_options& options):
+        buf(buf), bytes(reinterpret_cast<const char*>(buf.buf)),
+        options(options), offset(0) {}
+
+    // with checked set the whole term is validated before anything is decoded
+    PyObject* unpack(bool checked = false) {
+        if(!read_version()) {
+            return NULL;
+        }
+
+        if(checked) {
+            if(!inflate_if_compressed()) {
+                return NULL;
+            }
+
+            Py_ssize_t start = offset;
+            if(!validate_term()) {
+                return NULL;
+            }
+            offset = start;
+        }
+        return decode();
+    }
+
+    // walks the term once and returns a tuple with one entry per path in the plan.
+    // paths that were not found are left as NULL for the caller to fill in.
+    PyObject* match(const match_plan& plan) {
+        if(!read_version()) {
+            return NULL;
+        }
+
+        if(offset < buf.len && bytes[offset] == COMPRESSED_TERM) {
+            if(plan.spans) {
+                return PyErr_Format(earl_DecodeError, "Byte spans are not available for compressed terms");
+            }
+            ++offset;
+            if(!inflate()) {
+                return NULL;
+            }
+        }
+
+        PyObject* results = PyTuple_New(plan.slots);
+        if(results == NULL) {
+            return NULL;
+        }
+
+        Py_ssize_t remaining = plan.slots;
+        if(walk(plan.root, results, remaining, plan.spans) < 0) {
+            Py_DECREF(results);
+            return NULL;
+        }
+        return results;
+    }
+
+    // checks the whole term without creating any objects, so that bad input is turned
+    // away before anything gets built. DecodeError carries (message, offset) of the
+    // first problem. COMPRESSED_TERM is inflated first, offsets are then into the
+    // uncompressed term. returns the offset just past the term, or -1 on error
+    Py_ssize_t validate() {
+        if(!read_version() || !inflate_if_compressed()) {
+            return -1;
+        }
+        return validate_term() ? offset : -1;
+    }
+
+    ~unpacker() {
+        PyBuffer_Release(&buf);
+    }
+private:
+    Py_buffer buf;
+    const char* bytes;
+    unpack_options options;
+    Py_ssize_t offset;
+
+    bool read_version() {
+        const char* version = range(1);
+        if(version == NULL) {
+            return false;
+        }
+
+        if(*version != FORMAT_VERSION) {
+            PyErr_Format(earl_DecodeError, "Bad version. Expected '\\x%x', found '\\x%x' instead", FORMAT_VERSION & 0xFF, *version & 0xFF);
+            return false;
+        }
+        return true;
+    }
+
+    const char* get() {
+        if(offset > buf.len) {
+            PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd)", offset, buf.len);
+            return NULL;
+        }
+        return &bytes[offset++];
+    }
+
+    const char* range(Py_ssize_t count) {
+        if(offset + count > buf.len) {
+            PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd, count: %zd)", offset, buf.len, count);
+            return NULL;
+        }
+        const char* copy = bytes + offset;
+        offset += count;
+        return copy;
+    }
+
+    PyObject* decode() {
+        if(options.dedupe != NULL) {
+            return decode_shared();
+        }
+        return decode_term();
+    }
+
+    // decodes the next term, handing out the object from an earlier identical encoding
+    // when there is one
+    PyObject* decode_shared() {
+        Py_ssize_t start = offset;
+        Py_ssize_t end = shareable_end();
+        dedupe_table& table = *options.dedupe;
+        if(end < 0 || static_cast<size_t>(end - start) > table.max_span) {
+            return decode_term();
+        }
+
+        uint64_t hash = span_table::hash_bytes(bytes + start, end - start);
+        span_table::entry* found = table.find(bytes + start, end - start, hash);
+        if(found != NULL) {
+            // sized on the first hit, since most terms are never seen twice
+            if(found->value_size < 0) {
+                found->value_size = shared_size(found->value);
+                if(found->value_size < 0) {
+                    return NULL;
+                }
+            }
+            table.saved += found->value_size;
+            offset = end;
+            Py_INCREF(found->value);
+            return found->value;
+        }
+
+        PyObject* value = decode_term();
+        if(value != NULL && offset == end && is_immutable(value)) {
+            table.insert(bytes + start, end - start, hash, value).value_size = -1;
+        }
+        return value;
+    }
+
+    // where the term at offset ends if it decodes to something worth sharing, otherwise -1.
+    // small ints are already shared by Python, lists and maps are mutable
+    Py_ssize_t shareable_end() {
+        Py_ssize_t available = buf.len - offset;
+        if(available < 2) {
+            return -1;
+        }
+
+        const char* term = bytes + offset;
+        Py_ssize_t size;
+        switch(term[0]) {
+        case INTEGER_EXT: {
+            if(available < 5) {
+                return -1;
+            }
+            int32_t value = static_cast<int32_t>(from_big_endian<uint32_t>(term + 1));
+            size = value >= -5 && value <= 256 ? -1 : 5;
+            break;
+        }
+        case FLOAT_IEEE_EXT:
+            size = 9;
+            break;
+        case SMALL_BIG_EXT:
+            size = 3 + static_cast<unsigned char>(term[1]);
+            break;
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+            size = 2 + static_cast<unsigned char>(term[1]);
+            break;
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+        case STRING_EXT:
+            size = available < 3 ? -1 : 3 + from_big_endian<uint16_t>(term + 1);
+            break;
+        case BINARY_EXT:
+            size = available < 5 ? -1 : 5 + static_cast<Py_ssize_t>(from_big_endian<uint32_t>(term + 1));
+            break;
+        case SMALL_TUPLE_EXT:
+        case LARGE_TUPLE_EXT: {
+            // registered records may decode to anything
+            if(!records.empty()) {
+                return -1;
+            }
+
+            // only as far as max_span, or nested tuples would be walked once per level
+            Py_ssize_t start = offset;
+            bool ok = skip(options.dedupe->max_span);
+            size = offset - start;
+            offset = start;
+            if(!ok) {
+                PyErr_Clear(); // decoding it again raises the proper error, if any
+                return -1;
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+        return size < 0 || size > available ? -1 : offset + size;
+    }
+
+    static bool is_immutable(PyObject* obj) {
+        if(PyTuple_CheckExact(obj)) {
+            for(Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); ++i) {
+                if(!is_immutable(PyTuple_GET_ITEM(obj, i))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        return PyBytes_CheckExact(obj) || PyUnicode_CheckExact(obj) || PyFloat_CheckExact(obj) ||
+               PyLong_CheckExact(obj) || PyBool_Check(obj) || obj == Py_None;
+    }
+
+    // the memory a decoded term takes up, not counting objects Python shares anyway.
+    // returns -1 on error
+    static Py_ssize_t shared_size(PyObject* obj) {
+        if(obj == Py_None || PyBool_Check(obj)) {
+            return 0;
+        }
+
+        if(PyLong_CheckExact(obj)) {
+            int overflow;
+            long value = PyLong_AsLongAndOverflow(obj, &overflow);
+            if(!overflow && value >= -5 && value <= 256) {
+                return 0;
+            }
+        }
+
+        PyObject* size_obj = PyObject_CallMethod(obj, "__sizeof__", NULL);
+        if(size_obj == NULL) {
+            return -1;
+        }
+        Py_ssize_t size = PyLong_AsSsize_t(size_obj);
+        Py_DECREF(size_obj);
+
+        if(size >= 0 && PyTuple_CheckExact(obj)) {
+            for(Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); ++i) {
+                Py_ssize_t element = shared_size(PyTuple_GET_ITEM(obj, i));
+                if(element < 0) {
+                    return -1;
+                }
+                size += element;
+            }
+        }
+        return size;
+    }
+
+    PyObject* decode_term() {
+        EARL_GET_UNROLLED(op);
+        switch(op) {
+        case SMALL_INTEGER_EXT:
+            return small_int_ext();
+        case INTEGER_EXT:
+            return integer_ext();
+        case FLOAT_IEEE_EXT:
+            return float_ieee();
+        case SMALL_BIG_EXT:
+            return small_big_int();
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+            return atom_ext();
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+            return small_atom_ext();
+        case NIL_EXT:
+            return nil_ext();
+        case SMALL_TUPLE_EXT:
+            return small_tuple_ext();
+        case LARGE_TUPLE_EXT:
+            return large_tuple_ext();
+        case LIST_EXT:
+            return list_ext();
+        case STRING_EXT:
+            return string_ext();
+        case BINARY_EXT:
+            return binary_ext();
+        case MAP_EXT:
+            return map_ext();
+        case COMPRESSED_TERM:
+            return compressed();
+        default:
+            return PyErr_Format(earl_DecodeError, "Unexpected opcode: '\\x%x'", op);
+        }
+    }
+
+    // moves past the next term without creating any objects. gives up without an error
+    // once more than limit bytes have gone by
+    bool skip(Py_ssize_t limit = PY_SSIZE_T_MAX) {
+        Py_ssize_t start = offset;
+        uint64_t pending = 1;
+        while(pending > 0) {
+            --pending;
+            const char* op = range(1);
+            if(op == NULL) {
+                return false;
+            }
+
+            Py_ssize_t count = 0;
+            switch(*op) {
+            case SMALL_INTEGER_EXT:
+                count = 1;
+                break;
+            case INTEGER_EXT:
+                count = 4;
+                break;
+            case FLOAT_IEEE_EXT:
+                count = 8;
+                break;
+            case FLOAT_EXT:
+                count = 31;
+                break;
+            case NIL_EXT:
+                break;
+            case SMALL_ATOM_EXT:
+            case ATOM_UTF_SMALL_EXT:
+                if(!read_length(1, count)) {
+                    return false;
+                }
+                break;
+            case ATOM_EXT:
+            case ATOM_UTF_EXT:
+            case STRING_EXT:
+                if(!read_length(2, count)) {
+                    return false;
+                }
+                break;
+            case BINARY_EXT:
+                if(!read_length(4, count)) {
+                    return false;
+                }
+                break;
+            case SMALL_BIG_EXT:
+                if(!read_length(1, count)) {
+                    return false;
+                }
+                ++count; // sign byte
+                break;
+            case LARGE_BIG_EXT:
+                if(!read_length(4, count)) {
+                    return false;
+                }
+                ++count; // sign byte
+                break;
+            case SMALL_TUPLE_EXT:
+                if(!read_length(1, count)) {
+                    return false;
+                }
+                pending += count;
+                count = 0;
+                break;
+            case LARGE_TUPLE_EXT:
+                if(!read_length(4, count)) {
+                    return false;
+                }
+                pending += count;
+                count = 0;
+                break;
+            case LIST_EXT:
+                if(!read_length(4, count)) {
+                    return false;
+                }
+                pending += count + 1; // elements and the tail
+                count = 0;
+                break;
+            case MAP_EXT:
+                if(!read_length(4, count)) {
+                    return false;
+                }
+                pending += 2 * static_cast<uint64_t>(count);
+                count = 0;
+                break;
+            default:
+                PyErr_Format(earl_DecodeError, "Unexpected opcode: '\\x%x'", *op & 0xFF);
+                return false;
+            }
+
+            if(count > 0 && range(count) == NULL) {
+                return false;
+            }
+
+            if(offset - start > limit) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool inflate_if_compressed() {
+        if(offset < buf.len && bytes[offset] == COMPRESSED_TERM) {
+            ++offset;
+            return inflate();
+        }
+        return true;
+    }
+
+    bool fail(const char* message, Py_ssize_t at) {
+        PyObject* value = Py_BuildValue("(sn)", message, at);
+        if(value != NULL) {
+            PyErr_SetObject(earl_DecodeError, value);
+            Py_DECREF(value);
+        }
+        return false;
+    }
+
+    bool need(Py_ssize_t count) {
+        if(buf.len - offset < count) {
+            return fail("Unexpected end of byte string", offset);
+        }
+        return true;
+    }
+
+    bool validate_length(Py_ssize_t size, Py_ssize_t& length) {
+        return need(size) && read_length(size, length) && need(length);
+    }
+
+    bool validate_text(Py_ssize_t length, bool check) {
+        if(check) {
+            Py_ssize_t bad = invalid_utf8(reinterpret_cast<const unsigned char*>(bytes + offset), length);
+            if(bad >= 0) {
+                return fail("Invalid UTF-8", offset + bad);
+            }
+        }
+        offset += length;
+        return true;
+    }
+
+    struct validate_frame {
+        uint64_t remaining;
+        bool list;          // a NIL_EXT tail follows the elements
+    };
+
+    // containers still being checked. the first few levels live on the stack
+    struct frame_stack {
+        frame_stack(): depth(0) {}
+
+        void push(uint64_t remaining, bool list) {
+            validate_frame frame = { remaining, list };
+            if(depth < 32) {
+                shallow[depth] = frame;
+            }
+            else {
+                deep.push_back(frame);
+            }
+            ++depth;
+        }
+
+        validate_frame& top() {
+            return depth <= 32 ? shallow[depth - 1] : deep.back();
+        }
+
+        void pop() {
+            if(depth > 32) {
+                deep.pop_back();
+            }
+            --depth;
+        }
+
+        size_t depth;
+        validate_frame shallow[32];
+        std::vector<validate_frame> deep;
+    };
+
+    bool validate_term() {
+        // STRING_EXT and BINARY_EXT only have to be UTF-8 when they'll be decoded as such
+        bool strings = options.encoding != NULL && options.utf8;
+        bool binaries = strings && options.encode_binary_ext;
+
+        frame_stack stack;
+        stack.push(1, false);
+        while(stack.depth > 0) {
+            validate_frame& frame = stack.top();
+            if(frame.remaining == 0) {
+                if(frame.list) {
+                    if(!need(1)) {
+                        return false;
+                    }
+                    if(bytes[offset] != NIL_EXT) {
+                        return fail("Expected NIL_EXT after list", offset);
+                    }
+                    ++offset;
+                }
+                stack.pop();
+                continue;
+            }
+            --frame.remaining;
+
+            Py_ssize_t start = offset;
+            if(!need(1)) {
+                return false;
+            }
+
+            Py_ssize_t length;
+            char op = bytes[offset++];
+            switch(op) {
+            case SMALL_INTEGER_EXT:
+            case INTEGER_EXT:
+            case FLOAT_IEEE_EXT:
+                length = op == SMALL_INTEGER_EXT ? 1 : (op == INTEGER_EXT ? 4 : 8);
+                if(!need(length)) {
+                    return false;
+                }
+                offset += length;
+                break;
+            case SMALL_BIG_EXT:
+                if(!validate_length(1, length)) {
+                    return false;
+                }
+                if(length > 8) {
+                    return fail("big integer too big to unpack", start);
+                }
+                if(!need(length + 1)) {
+                    return false;
+                }
+                offset += length + 1;
+                break;
+            case SMALL_ATOM_EXT:
+            case ATOM_UTF_SMALL_EXT:
+            case ATOM_EXT:
+            case ATOM_UTF_EXT: {
+                bool small = op == SMALL_ATOM_EXT || op == ATOM_UTF_SMALL_EXT;
+                if(!validate_length(small ? 1 : 2, length) || !validate_text(length, true)) {
+                    return false;
+                }
+                break;
+            }
+            case STRING_EXT:
+                if(!validate_length(2, length) || !validate_text(length, strings)) {
+                    return false;
+                }
+                break;
+            case BINARY_EXT:
+                if(!validate_length(4, length) || !validate_text(length, binaries)) {
+                    return false;
+                }
+                break;
+            case NIL_EXT:
+                break;
+            case SMALL_TUPLE_EXT:
+            case LARGE_TUPLE_EXT:
+            case LIST_EXT:
+            case MAP_EXT: {
+                if(!need(op == SMALL_TUPLE_EXT ? 1 : 4) || !read_length(op == SMALL_TUPLE_EXT ? 1 : 4, length)) {
+                    return false;
+                }
+
+                // every element takes at least a byte, which catches absurd lengths right away
+                uint64_t count = op == MAP_EXT ? 2 * static_cast<uint64_t>(length) : length;
+                if(count + (op == LIST_EXT) > static_cast<uint64_t>(buf.len - offset)) {
+                    return fail("Unexpected end of byte string", offset);
+                }
+                stack.push(count, op == LIST_EXT);
+                break;
+            }
+            default:
+                return fail("Unexpected opcode", start);
+            }
+        }
+        return true;
+    }
+
+    bool read_length(Py_ssize_t size, Py_ssize_t& length) {
+        const char* len = range(size);
+        if(len == NULL) {
+            return false;
+        }
+
+        switch(size) {
+        case 1:
+            length = static_cast<unsigned char>(*len);
+            break;
+        case 2:
+            length = from_big_endian<uint16_t>(len);
+            break;
+        default:
+            length = from_big_endian<uint32_t>(len);
+            break;
+        }
+        return true;
+    }
+
+    // reads a map key and finds the step it selects, if any
+    bool select_key(const std::vector<match_step>& steps, const match_step** selected) {
+        *selected = NULL;
+        Py_ssize_t start = offset;
+        const char* op = range(1);
+        if(op == NULL) {
+            return false;
+        }
+
+        int kind;
+        Py_ssize_t length = 0;
+        long long integer = 0;
+        switch(*op) {
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+            kind = match_kind::atom;
+            if(!read_length(1, length)) {
+                return false;
+            }
+            break;
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+            kind = match_kind::atom;
+            if(!read_length(2, length)) {
+                return false;
+            }
+            break;
+        case STRING_EXT:
+            kind = match_kind::binary;
+            if(!read_length(2, length)) {
+                return false;
+            }
+            break;
+        case BINARY_EXT:
+            kind = match_kind::binary;
+            if(!read_length(4, length)) {
+                return false;
+            }
+            break;
+        case SMALL_INTEGER_EXT: {
+            kind = match_kind::integer;
+            const char* value = range(1);
+            if(value == NULL) {
+                return false;
+            }
+            integer = static_cast<unsigned char>(*value);
+            break;
+        }
+        case INTEGER_EXT: {
+            kind = match_kind::integer;
+            const char* value = range(4);
+            if(value == NULL) {
+                return false;
+            }
+            integer = static_cast<int32_t>(from_big_endian<uint32_t>(value));
+            break;
+        }
+        default:
+            offset = start;
+            return skip();
+        }
+
+        const char* key = range(length);
+        if(key == NULL) {
+            return false;
+        }
+
+        for(size_t i = 0; i < steps.size(); ++i) {
+            const match_step& step = steps[i];
+            bool found;
+            if(kind == match_kind::integer) {
+                found = step.kind == match_kind::integer && step.integer == integer;
+            }
+            else {
+                // str keys match atoms and binaries alike, bytes and atom keys only their own kind
+                found = (step.kind == kind || step.kind == match_kind::text) &&
+                        step.bytes.size() == static_cast<size_t>(length) &&
+                        memcmp(step.bytes.data(), key, length) == 0;
+            }
+
+            if(found) {
+                *selected = &step;
+                break;
+            }
+        }
+        return true;
+    }
+
+    static const match_step* select_position(const std::vector<match_step>& steps, uint32_t position) {
+        for(size_t i = 0; i < steps.size(); ++i) {
+            if(steps[i].kind == match_kind::integer && steps[i].integer == position) {
+                return &steps[i];
+            }
+        }
+        return NULL;
+    }
+
+    // returns -1 on error, 1 once every path has been found and 0 otherwise
+    int walk(const std::vector<match_step>& steps, PyObject* results, Py_ssize_t& remaining, bool spans) {
+        Py_ssize_t start = offset;
+        const char* op = range(1);
+        if(op == NULL) {
+            return -1;
+        }
+
+        char tag = *op;
+        Py_ssize_t length;
+        switch(tag) {
+        case SMALL_TUPLE_EXT:
+            if(!read_length(1, length)) {
+                return -1;
+            }
+            break;
+        case LARGE_TUPLE_EXT:
+        case LIST_EXT:
+        case MAP_EXT:
+            if(!read_length(4, length)) {
+                return -1;
+            }
+            break;
+        default:
+            // not a container so nothing below it can match
+            offset = start;
+            return skip() ? 0 : -1;
+        }
+
+        for(Py_ssize_t i = 0; i < length; ++i) {
+            const match_step* step = NULL;
+            if(tag == MAP_EXT) {
+                if(!select_key(steps, &step)) {
+                    return -1;
+                }
+            }
+            else {
+                step = select_position(steps, i);
+            }
+
+            if(step == NULL) {
+                if(!skip()) {
+                    return -1;
+                }
+                continue;
+            }
+
+            int ret = visit(*step, results, remaining, spans);
+            if(ret != 0) {
+                return ret;
+            }
+        }
+
+        if(tag == LIST_EXT && !skip()) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int visit(const match_step& step, PyObject* results, Py_ssize_t& remaining, bool spans) {
+        Py_ssize_t start = offset;
+        if(step.slot >= 0 && PyTuple_GET_ITEM(results, step.slot) == NULL) {
+            PyObject* value = NULL;
+            if(spans) {
+                value = skip() ? Py_BuildValue("(nn)", start, offset) : NULL;
+            }
+            else {
+                value = decode();
+            }
+
+            if(value == NULL) {
+                return -1;
+            }
+
+            PyTuple_SET_ITEM(results, step.slot, value);
+            if(--remaining == 0) {
+                return 1;
+            }
+
+            if(step.children.empty()) {
+                return 0;
+            }
+            // a longer path continues below this value
+            offset = start;
+        }
+
+        if(step.children.empty()) {
+            return skip() ? 0 : -1;
+        }
+        return walk(step.children, results, remaining, spans);
+    }
+
+    PyObject* small_int_ext() {
+        const char* byte = get();
+        return byte ? PyLong_FromUnsignedLong(static_cast<unsigned char>(*byte)) : NULL;
+    }
+
+    PyObject* integer_ext() {
+        const char* ret = range(4);
+        if(ret == NULL) {
+            return NULL;
+        }
+        int32_t x = 0;
+#if PY_BIG_ENDIAN
+        memcpy(&x, value, length);
+#else
+        char buf[4]; // enough to fill our bytes
+        char* end = &buf[3];
+        for(Py_ssize_t i = 0; i < 4; ++i) {
+            *end-- = *ret++;
+        }
+        memcpy(&x, buf, 4);
+#endif // endian check
+        return PyLong_FromLong(x);
+    }
+
+    PyObject* small_big_int() {
+        EARL_GET_UNROLLED(length);
+        const char* e = range(length + 1);
+        if(e == NULL) {
+            return NULL;
+        }
+
+        if(length > 8) {
+            return PyErr_Format(earl_DecodeError, "big integer too big to unpack, expected up to 8 bytes"
+                                                  " but received %d bytes instead", length);
+        }
+
+        return convert_big_integer(e, length);
+    }
+
+    PyObject* convert_big_integer(const char* value, Py_ssize_t length) {
+        // length does not contain the sign bit but value does
+        uint8_t sign = *value++;
+
+        // the easy ULL case
+        if(sign == 0) {
+            uint64_t ret = 0;
+#if PY_BIG_ENDIAN
+            char buf[8]; // enough to fill our bytes
+            char* end = &buf[length - 1];
+            for(Py_ssize_t i = 0; i < length; ++i) {
+                *end-- = *value++;
+            }
+            memcpy(&ret, buf, length);
+#else
+            memcpy(&ret, value, length);
+#endif // endian check
+            return PyLong_FromUnsignedLongLong(ret);
+        }
+
+        uint64_t val = 0;
+        uint64_t b = 1;
+        for(Py_ssize_t i = 0; i < length; ++i) {
+            val += static_cast<unsigned char>(*value) * b;
+            b <<= 8;
+            ++value;
+        }
+
+        PyObject* ret = PyLong_FromUnsignedLongLong(val);
+
+        // negate if necessary
+        if(sign == 0) {
+            return ret;
+        }
+        else {
+            PyObject* val = PyNumber_Negative(ret);
+            Py_DECREF(ret);
+            if(val == NULL) {
+                return NULL;
+            }
+            return val;
+        }
+    }
+
+    PyObject* float_ieee() {
+        const char* ret = range(8);
+        if(ret == NULL) {
+            return NULL;
+        }
+
+        double x;
+#if PY_BIG_ENDIAN
+        memcpy(&x, ret, 8);
+#else
+        char buf[8];
+        char* end = &buf[7];
+        for(unsigned i = 0; i < 8; ++i) {
+            *end-- = *ret++;
+        }
+        memcpy(&x, buf, 8);
+#endif // endian check
+
+        return PyFloat_FromDouble(x);
+    }
+
+    PyObject* atom_ext() {
+        const char* len_bytes = range(2);
+        if(len_bytes == NULL) {
+            return NULL;
+        }
+        uint16_t length = from_big_endian<uint16_t>(len_bytes);
+        return convert_atom(length);
+    }
+
+    PyObject* small_atom_ext() {
+        EARL_GET_UNROLLED(length);
+        return convert_atom(length);
+    }
+
+    PyObject* convert_atom(Py_ssize_t length) {
+        const char* atom = range(length);
+        if(atom == NULL) {
+            return NULL;
+        }
+
+        if(length >= 3 && length <= 5) {
+            if(length == 3 && strncmp(atom, "nil", 3) == 0) {
+                Py_RETURN_NONE;
+            }
+            else if(length == 4 && strncmp(atom, "true", 4) == 0) {
+                Py_RETURN_TRUE;
+            }
+            else if(length == 5 && strncmp(atom, "false", 5) == 0) {
+                Py_RETURN_FALSE;
+            }
+        }
+
+        // we return atoms as UTF-8 encoded unicode strings
+        return PyUnicode_DecodeUTF8(atom, length, NULL);
+    }
+
+    PyObject* nil_ext() {
+        return PyList_New(0); // empty list
+    }
+
+    PyObject* small_tuple_ext() {
+        EARL_GET_UNROLLED(length);
+        return create_tuple(length);
+    }
+
+    PyObject* large_tuple_ext() {
+        EARL_GET_LENGTH
+        return create_tuple(length);
+    }
+
+    PyObject* create_tuple(Py_ssize_t length) {
+        if(!records.empty()) {
+            const record_entry* record = find_record(length);
+            if(record != NULL) {
+                return create_record(*record, length);
+            }
+        }
+
+        if(length > buf.len - offset) {
+            return PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd, count: %zd)", offset, buf.len, length);
+        }
+
+        PyObject* tuple = PyTuple_New(length);
+        if(tuple == NULL) {
+            return NULL;
+        }
+
+        for(Py_ssize_t i = 0; i < length; ++i) {
+            PyObject* element = decode();
+            if(element == NULL) {
+                Py_DECREF(tuple);
+                return NULL;
+            }
+            PyTuple_SET_ITEM(tuple, i, element);
+        }
+        return tuple;
+    }
+
+    // looks at the tag atom a tuple of this size starts with, without consuming it
+    const record_entry* find_record(Py_ssize_t arity) {
+        if(offset + 2 > buf.len) {
+            return NULL;
+        }
+
+        Py_ssize_t header;
+        Py_ssize_t length;
+        switch(bytes[offset]) {
+        case SMALL_ATOM_EXT:
+        case ATOM_UTF_SMALL_EXT:
+            header = 2;
+            length = static_cast<unsigned char>(bytes[offset + 1]);
+            break;
+        case ATOM_EXT:
+        case ATOM_UTF_EXT:
+            header = 3;
+            if(offset + header > buf.len) {
+                return NULL;
+            }
+            length = from_big_endian<uint16_t>(bytes + offset + 1);
+            break;
+        default:
+            return NULL;
+        }
+
+        if(offset + header + length > buf.len) {
+            return NULL;
+        }
+
+        const char* tag = bytes + offset + header;
+        for(size_t i = 0; i < records.size(); ++i) {
+            const record_entry& record = records[i];
+            if(record.arity == arity && record.tag.size() == static_cast<size_t>(length) &&
+               memcmp(record.tag.data(), tag, length) == 0) {
+                return &record;
+            }
+        }
+        return NULL;
+    }
+
+    PyObject* create_record(const record_entry& record, Py_ssize_t length) {
+        // the factory can run arbitrary code, so don't hold on to the registry entry
+        PyObject* factory = record.factory;
+        bool fill_tuple = record.fill_tuple;
+        Py_ssize_t size = length - 1;
+        if(!skip()) {
+            return NULL; // the tag
+        }
+
+        if(fill_tuple) {
+            PyTypeObject* type = reinterpret_cast<PyTypeObject*>(factory);
+            PyObject* tuple = type->tp_alloc(type, size);
+            if(tuple == NULL) {
+                return NULL;
+            }
+
+            for(Py_ssize_t i = 0; i < size; ++i) {
+                PyObject* element = decode();
+                if(element == NULL) {
+                    Py_DECREF(tuple);
+                    return NULL;
+                }
+                PyTuple_SET_ITEM(tuple, i, element);
+            }
+            return tuple;
+        }
+
+        Py_INCREF(factory);
+        std::vector<PyObject*> args;
+        args.reserve(size);
+        for(Py_ssize_t i = 0; i < size; ++i) {
+            PyObject* element = decode();
+            if(element == NULL) {
+                break;
+            }
+            args.push_back(element);
+        }
+
+        PyObject* ret = NULL;
+        if(static_cast<Py_ssize_t>(args.size()) == size) {
+            ret = PyObject_Vectorcall(factory, args.data(), size, NULL);
+        }
+
+        for(size_t i = 0; i < args.size(); ++i) {
+            Py_DECREF(args[i]);
+        }
+        Py_DECREF(factory);
+        return ret;
+    }
+
+    PyObject* list_ext() {
+        EARL_GET_LENGTH
+        if(static_cast<Py_ssize_t>(length) >= buf.len - offset) {
+            return PyErr_Format(earl_DecodeError, "Unexpected end of byte string found (offset: %zd, size: %zd, count: %u)", offset, buf.len, length);
+        }
+
+        PyObject* list = PyList_New(length);
+        if(list == NULL) {
+            return NULL;
+        }
+
+        for(Py_ssize_t i = 0; i < length; ++i) {
+            PyObject* element = decode();
+            if(element == NULL) {
+                Py_DECREF(list);
+                return NULL;
+            }
+            PyList_SET_ITEM(list, i, element);
+        }
+
+        EARL_GET_UNROLLED(op);
+        if(op != NIL_EXT) {
+            PyErr_SetString(earl_DecodeError, "Expected NIL_EXT after list but did not receive one");
+            Py_DECREF(list);
+            return NULL;
+        }
+        return list;
+    }
+
+    PyObject* string_ext() {
+        const char* len = range(2);
+        if(len == NULL) {
+            return NULL;
+        }
+        uint16_t length = from_big_endian<uint16_t>(len);
+        const char* string_bytes = range(length);
+        if(string_bytes == NULL) {
+            return NULL;
+        }
+
+        if(options.encoding == NULL) {
+            // no encoding, so just return a bytes object
+            return PyBytes_FromStringAndSize(string_bytes, length);
+        }
+
+        return decode_text(string_bytes, length);
+    }
+
+    PyObject* binary_ext() {
+        EARL_GET_LENGTH
+        const char* string_bytes = range(length);
+        if(string_bytes == NULL) {
+            return NULL;
+        }
+        if(!options.encode_binary_ext || options.encoding == NULL) {
+            return PyBytes_FromStringAndSize(string_bytes, length);
+        }
+        return decode_text(string_bytes, length);
+    }
+
+    PyObject* decode_text(const char* text, Py_ssize_t length) {
+        if(options.utf8) {
+            return PyUnicode_DecodeUTF8(text, length, "strict");
+        }
+        return PyUnicode_Decode(text, length, options.encoding, "strict");
+    }
+
+    PyObject* map_ext() {
+        EARL_GET_LENGTH
+        // a key and a value take at least two bytes, so don't trust the length beyond that
+        PyObject* dict = earl_dict_presized(std::min<Py_ssize_t>(length, (buf.len - offset) / 2));
+        if(dict == NULL) {
+            return NULL;
+        }
+
+        for(Py_ssize_t i = 0; i < length; ++i) {
+            Py_hash_t hash = -1;
+            PyObject* key = options.keys != NULL ? map_key(hash) : decode();
+            if(key == NULL) {
+                PyDict_Clear(dict);
+                Py_DECREF(dict);
+                return NULL;
+            }
+
+            PyObject* value = decode();
+            if(value == NULL) {
+                Py_DECREF(key);
+                PyDict_Clear(dict);
+                Py_DECREF(dict);
+                return NULL;
+            }
+
+            int ret = hash != -1 ? earl_dict_set_known_hash(dict, key, value, hash) : PyDict_SetItem(dict, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+
+            if(ret < 0) {
+                PyDict_Clear(dict);
+                Py_DECREF(dict);
+                return NULL;
+            }
+        }
+
+        return dict;
+    }
+
+    // short STRING_EXT and BINARY_EXT keys that decode as UTF-8 come from the key cache,
+    // along with their hash. everything else is decoded as usual and hash left at -1
+    PyObject* map_key(Py_hash_t& hash) {
+        if(!options.utf8 || offset >= buf.len) {
+            return decode();
+        }
+
+        char op = bytes[offset];
+        Py_ssize_t header = op == STRING_EXT ? 3 : 5;
+        if((op != STRING_EXT && (op != BINARY_EXT || !options.encode_binary_ext)) || buf.len - offset < header) {
+            return decode();
+        }
+
+        Py_ssize_t length = op == STRING_EXT ? from_big_endian<uint16_t>(bytes + offset + 1)
+                                             : from_big_endian<uint32_t>(bytes + offset + 1);
+        if(static_cast<size_t>(length) > options.keys->max_key_size || length > buf.len - offset - header) {
+            return decode();
+        }
+
+        PyObject* key = options.keys->find(bytes + offset + header, length, hash);
+        if(key != NULL) {
+            offset += header + length;
+        }
+        return key;
+    }
+
+    PyObject* compressed() {
+        if(!inflate()) {
+            return NULL;
+        }
+        return decode();
+    }
+
+    // replaces our buffer with the decompressed payload of a COMPRESSED_TERM
+    bool inflate() {
+        const char* len = range(4);
+        if(len == NULL) {
+            return false;
+        }
+        uint32_t length = from_big_endian<uint32_t>(len);
+
+        PyObject* zlib = PyImport_ImportModule("zlib");
+        if(zlib == NULL) {
+            return false;
+        }
+
+        PyObject* view = PyMemoryView_FromMemory(const_cast<char*>(bytes + offset), buf.len - offset, PyBUF_READ);
+        if(view == NULL) {
+            Py_DECREF(zlib);
+            return false;
+        }
+
+        PyObject* new_bytes = PyObject_CallMethod(zlib, "decompress", "Oin", view, 15, static_cast<Py_ssize_t>(length));
+        Py_DECREF(view);
+        Py_DECREF(zlib);
+        if(new_bytes == NULL) {
+            return false;
+        }
+
+        Py_buffer buffer;
+        int ret = PyObject_GetBuffer(new_bytes, &buffer, PyBUF_C_CONTIGUOUS);
+        Py_DECREF(new_bytes); // the buffer keeps its own reference
+        if(ret < 0) {
+            return false;
+        }
+
+        // replace ourselves with the new buffer
+        PyBuffer_Release(&buf);
+        buf = buffer;
+        bytes = reinterpret_cast<const char*>(buf.buf);
+        offset = 0;
+        return true;
+    }
+};
+
+#undef EARL_GET_UNROLLED
+#undef EARL_GET_LENGTH
+
+// matches fastcall arguments against names the way PyArg_ParseTupleAndKeywords would,
+// without building an args tuple and kwargs dict first. only the first `positional`
+// names can be given positionally. values are borrowed and NULL when not given.
+static bool parse_fastcall(const char* function, const char* const* names, Py_ssize_t positional, Py_ssize_t required,
+                           PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, PyObject** values) {
+    Py_ssize_t count = 0;
+    while(names[count] != NULL) {
+        values[count] = count < nargs ? args[count] : NULL;
+        ++count;
+    }
+
+    if(nargs > positional) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd positional arguments (%zd given)", function, positional, nargs);
+        return false;
+    }
+
+    Py_ssize_t keywords = kwnames == NULL ? 0 : PyTuple_GET_SIZE(kwnames);
+    for(Py_ssize_t k = 0; k < keywords; ++k) {
+        PyObject* name = PyTuple_GET_ITEM(kwnames, k);
+        Py_ssize_t index = 0;
+        while(index < count && PyUnicode_CompareWithASCIIString(name, names[index]) != 0) {
+            ++index;
+        }
+
+        if(index == count) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", function, name);
+            return false;
+        }
+
+        if(values[index] != NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", function, names[index]);
+            return false;
+        }
+        values[index] = args[nargs + k];
+    }
+
+    for(Py_ssize_t index = 0; index < required; ++index) {
+        if(values[index] == NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", function, names[index]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the option readers leave the default alone when the value wasn't given
+static bool read_encoding(PyObject* value, const char** encoding, bool allow_none) {
+    if(value == NULL || (allow_none && value == Py_None)) {
+        return true;
+    }
+
+    if(!PyUnicode_Check(value)) {
+        PyErr_Format(PyExc_TypeError, "encoding must be a str, not %.200s", Py_TYPE(value)->tp_name);
+        return false;
+    }
+
+    // the characters live as long as the str does
+    *encoding = PyUnicode_AsUTF8(value);
+    return *encoding != NULL;
+}
+
+static bool read_flag(PyObject* value, bool* flag) {
+    if(value == NULL) {
+        return true;
+    }
+
+    int ret = PyObject_IsTrue(value);
+    *flag = ret > 0;
+    return ret >= 0;
+}
+
+static bool read_int(PyObject* value, int* integer) {
+    if(value == NULL) {
+        return true;
+    }
+
+    long ret = PyLong_AsLong(value);
+    if(ret == -1 && PyErr_Occurred()) {
+        return false;
+    }
+    *integer = ret;
+    return true;
+}
+
+static bool read_size(PyObject* value, Py_ssize_t* size) {
+    if(value == NULL) {
+        return true;
+    }
+
+    *size = PyLong_AsSsize_t(value);
+    return !(*size == -1 && PyErr_Occurred());
+}
+
+// keyword options shared by every packing function, in the order read_pack_options reads them
+#define EARL_PACK_OPTIONS "encoding", "encode_mode", "namedtuple_as_record", "enum_as_atom", "deterministic"
+
+static bool read_pack_options(PyObject** values, pack_options& options) {
+    const char* encoding = options.encoding;
+    if(!read_encoding(values[0], &encoding, true) || !read_int(values[1], &options.encode_mode) ||
+       !read_flag(values[2], &options.namedtuple_as_record) || !read_flag(values[3], &options.enum_as_atom) ||
+       !read_flag(values[4], &options.deterministic)) {
+        return false;
+    }
+    options.set_encoding(encoding);
+    return true;
+}
+
+// and the same for unpacking
+#define EARL_UNPACK_OPTIONS "encoding", "encode_binary_ext"
+
+static bool read_unpack_options(PyObject** values, unpack_options& options) {
+    const char* encoding = options.encoding;
+    if(!read_encoding(values[0], &encoding, true) || !read_flag(values[1], &options.encode_binary_ext)) {
+        return false;
+    }
+    options.set_encoding(encoding);
+    return true;
+}
+
+// a KeyCache can be shared by any number of unpack calls and codecs
+struct earl_KeyCache {
+    PyObject_HEAD
+    key_cache* cache;
+};
+
+// the key_cache behind an optional key_cache argument, or NULL if there is none
+static bool read_key_cache(PyObject* value, key_cache** cache) {
+    if(value == NULL || value == Py_None) {
+        return true;
+    }
+
+    if(!PyObject_TypeCheck(value, reinterpret_cast<PyTypeObject*>(key_cache_type))) {
+        PyErr_Format(PyExc_TypeError, "key_cache must be a KeyCache, not %.200s", Py_TYPE(value)->tp_name);
+        return false;
+    }
+    *cache = reinterpret_cast<earl_KeyCache*>(value)->cache;
+    return true;
+}
+
+// a DedupeTable keeps immutable terms alive between unpack calls
+struct earl_DedupeTable {
+    PyObject_HEAD
+    dedupe_table* table;
+};
+
+// the dedupe_table behind a dedupe argument. a true value that isn't a DedupeTable asks for
+// a table that only lives for the call, which is left for the caller to create
+static bool read_dedupe(PyObject* value, dedupe_table** table, bool* temporary) {
+    if(value == NULL) {
+        return true;
+    }
+
+    if(PyObject_TypeCheck(value, reinterpret_cast<PyTypeObject*>(dedupe_type))) {
+        *table = reinterpret_cast<earl_DedupeTable*>(value)->table;
+        return true;
+    }
+    return read_flag(value, temporary);
+}
+
+static PyObject* earl_pack(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "obj", "digest", EARL_PACK_OPTIONS, NULL };
+    PyObject* values[7];
+    bool digest = false;
+    pack_options options;
+
+    // the common earl.pack(obj) call needs no parsing at all
+    if(nargs != 1 || kwnames != NULL) {
+        if(!parse_fastcall("pack", kwlist, 1, 1, args, nargs, kwnames, values) ||
+           !read_flag(values[1], &digest) || !read_pack_options(values + 2, options)) {
+            return NULL;
+        }
+    }
+    else {
+        values[0] = args[0];
+    }
+
+    packer p(options);
+    if(!digest) {
+        return p.pack(values[0]);
+    }
+
+    xxh64 hash;
+    p.digest_into(&hash);
+    PyObject* ret = p.pack(values[0]);
+    if(ret == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("NK", ret, static_cast<unsigned long long>(hash.digest()));
+}
+
+static PyObject* earl_pack_to(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "obj", "writer", "chunk_size", "compressed", "digest", EARL_PACK_OPTIONS, NULL };
+    PyObject* values[10];
+    Py_ssize_t chunk_size = 64 * 1024;
+    bool digest = false;
+    pack_options options;
+
+    if(!parse_fastcall("pack_to", kwlist, 2, 2, args, nargs, kwnames, values) || !read_size(values[2], &chunk_size) ||
+       !read_flag(values[4], &digest) || !read_pack_options(values + 5, options)) {
+        return NULL;
+    }
+
+    PyObject* to_pack = values[0];
+    PyObject* writer = values[1];
+    PyObject* compressed = values[3] != NULL ? values[3] : Py_False;
+
+    if(chunk_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+
+    // same as term_to_binary: compressed means level 6, or a level from 0 to 9
+    long level = 0;
+    if(PyBool_Check(compressed)) {
+        level = compressed == Py_True ? 6 : 0;
+    }
+    else {
+        level = PyLong_AsLong(compressed);
+        if(level == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if(level < 0 || level > 9) {
+            PyErr_SetString(PyExc_ValueError, "compressed must be a bool or a level from 0 to 9");
+            return NULL;
+        }
+    }
+
+    sink* out;
+    PyObject* write_method = NULL;
+    if(PyLong_Check(writer)) {
+        int fd = PyLong_AsLong(writer);
+        if(fd == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        out = new fd_sink(fd);
+    }
+    else {
+        int raw = is_raw_stream(writer);
+        if(raw < 0) {
+            return NULL;
+        }
+
+        write_method = PyObject_GetAttrString(writer, "write");
+        if(write_method == NULL) {
+            return NULL;
+        }
+        out = new writer_sink(write_method, raw);
+    }
+
+    // the digest is of the uncompressed term, the same as pack(obj, digest=True) gives
+    xxh64 hash;
+    int ret;
+    if(level == 0) {
+        packer p(options, out, chunk_size, chunk_size);
+        p.digest_into(&hash);
+        ret = p.stream(to_pack, true) || out->finish();
+    }
+    else {
+        // COMPRESSED_TERM needs the uncompressed size up front, so measure it first
+        sink counter;
+        packer sizer(options, &counter, chunk_size, chunk_size);
+        sizer.expect_second_pass();
+        ret = sizer.stream(to_pack, false);
+        if(!ret && counter.total > UINT32_MAX) {
+            PyErr_SetString(earl_EncodeError, "term is too big to be compressed");
+            ret = 1;
+        }
+
+        zlib_sink compressor(out);
+        if(!ret) {
+            unsigned char header[6];
+            header[0] = FORMAT_VERSION;
+            header[1] = COMPRESSED_TERM;
+            as_big_endian32(header + 2, counter.total);
+            ret = compressor.start(level) || out->write(reinterpret_cast<const char*>(header), sizeof(header));
+        }
+
+        if(!ret) {
+            packer p(options, &compressor, chunk_size, chunk_size);
+            hash.update(&FORMAT_VERSION, 1);
+            p.digest_into(&hash);
+            ret = p.stream(to_pack, false) || compressor.finish();
+        }
+
+        // an iterator only packs once, so the second pass comes out different
+        if(!ret && compressor.total != counter.total) {
+            PyErr_SetString(earl_EncodeError, "term changed between passes, iterators can't be compressed");
+            ret = 1;
+        }
+    }
+
+    Py_ssize_t total = out->total;
+    delete out;
+    Py_XDECREF(write_method);
+    if(ret) {
+        return NULL;
+    }
+
+    if(digest) {
+        return Py_BuildValue("nK", total, static_cast<unsigned long long>(hash.digest()));
+    }
+    return PyLong_FromSsize_t(total);
+}
+
+static PyObject* earl_pack_chunked(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "obj", "max_bytes", "wrap", EARL_PACK_OPTIONS, NULL };
+    PyObject* values[8];
+    Py_ssize_t max_bytes = 0;
+    pack_options options;
+
+    if(!parse_fastcall("pack_chunked", kwlist, 2, 2, args, nargs, kwnames, values) ||
+       !read_size(values[1], &max_bytes) || !read_pack_options(values + 3, options)) {
+        return NULL;
+    }
+
+    // the envelope is packed once and split around earl.CHUNK
+    std::string prefix(1, FORMAT_VERSION);
+    std::string suffix;
+    PyObject* wrap = values[2];
+    if(wrap != NULL && wrap != Py_None) {
+        PyObject* envelope;
+        if(PyCallable_Check(wrap)) {
+            envelope = PyObject_CallFunctionObjArgs(wrap, chunk_marker, NULL);
+        }
+        else {
+            envelope = wrap;
+            Py_INCREF(envelope);
+        }
+
+        if(envelope == NULL) {
+            return NULL;
+        }
+
+        packer p(options);
+        p.pack_envelope();
+        PyObject* packed = p.pack(envelope);
+        Py_DECREF(envelope);
+        if(packed == NULL) {
+            return NULL;
+        }
+
+        std::string bytes(PyBytes_AS_STRING(packed), PyBytes_GET_SIZE(packed));
+        Py_DECREF(packed);
+        size_t marker_size = sizeof(CHUNK_ATOM) - 1;
+        size_t at = bytes.find(CHUNK_ATOM, 0, marker_size);
+        if(at == std::string::npos || bytes.find(CHUNK_ATOM, at + 1, marker_size) != std::string::npos) {
+            PyErr_SetString(PyExc_ValueError, "wrap must contain earl.CHUNK exactly once");
+            return NULL;
+        }
+        prefix.assign(bytes, 0, at);
+        suffix.assign(bytes, at + marker_size, std::string::npos);
+    }
+
+    // an empty list or map has to fit in the envelope at least
+    if(max_bytes < static_cast<Py_ssize_t>(prefix.size() + suffix.size() + 6)) {
+        PyErr_SetString(PyExc_ValueError, "max_bytes is too small for the envelope");
+        return NULL;
+    }
+
+    packer p(options);
+    return p.chunked(values[0], prefix, suffix, max_bytes);
+}
+
+static PyObject* earl_pack_iov(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "obj", "min_ref_size", EARL_PACK_OPTIONS, NULL };
+    PyObject* values[7];
+    Py_ssize_t min_ref_size = 16 * 1024;
+    pack_options options;
+
+    if(!parse_fastcall("pack_iov", kwlist, 1, 1, args, nargs, kwnames, values) ||
+       !read_size(values[1], &min_ref_size) || !read_pack_options(values + 2, options)) {
+        return NULL;
+    }
+
+    PyObject* to_pack = values[0];
+
+    if(min_ref_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "min_ref_size must be positive");
+        return NULL;
+    }
+
+    PyObject* segments = PyList_New(0);
+    if(segments == NULL) {
+        return NULL;
+    }
+
+    // small pieces are only flushed when a reference has to follow them
+    iov_sink out(segments);
+    packer p(options, &out, packer::no_flush, min_ref_size);
+    if(p.stream(to_pack, true)) {
+        Py_DECREF(segments);
+        return NULL;
+    }
+    return segments;
+}
+
+static PyObject* earl_unpack(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "data", "validate", "key_cache", "dedupe", EARL_UNPACK_OPTIONS, NULL };
+    PyObject* values[6];
+    bool validate = false;
+    bool temporary = false;
+    unpack_options options;
+    Py_buffer buf;
+
+    if(nargs != 1 || kwnames != NULL) {
+        if(!parse_fastcall("unpack", kwlist, 1, 1, args, nargs, kwnames, values) || !read_flag(values[1], &validate) ||
+           !read_key_cache(values[2], &options.keys) || !read_dedupe(values[3], &options.dedupe, &temporary) ||
+           !read_unpack_options(values + 4, options)) {
+            return NULL;
+        }
+    }
+    else {
+        values[0] = args[0];
+    }
+
+    if(options.dedupe != NULL && !options.dedupe->bind(options)) {
+        PyErr_SetString(PyExc_ValueError, "the DedupeTable was used with other encoding options, clear() it first");
+        return NULL;
+    }
+
+    if(PyObject_GetBuffer(values[0], &buf, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    // a table for one call is sized by the data, since a term takes at least two bytes
+    if(temporary) {
+        size_t capacity = std::min<size_t>(static_cast<size_t>(buf.len) / 16, 65536);
+        options.dedupe = new dedupe_table(capacity, 256);
+    }
+
+    unpacker p(buf, options);
+    PyObject* unpacked = p.unpack(validate);
+    if(temporary) {
+        delete options.dedupe;
+    }
+    return unpacked;
+}
+
+static PyObject* earl_validate(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "data", EARL_UNPACK_OPTIONS, NULL };
+    PyObject* values[3];
+    unpack_options options;
+    Py_buffer buf;
+
+    if(!parse_fastcall("validate", kwlist, 1, 1, args, nargs, kwnames, values) ||
+       !read_unpack_options(values + 1, options)) {
+        return NULL;
+    }
+
+    if(PyObject_GetBuffer(values[0], &buf, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    unpacker p(buf, options);
+    Py_ssize_t end = p.validate();
+    return end < 0 ? NULL : PyLong_FromSsize_t(end);
+}
+
+static PyObject* earl_register_record(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "tag", "arity", "factory", NULL };
+    const char* tag;
+    Py_ssize_t tag_size;
+    Py_ssize_t arity;
+    PyObject* factory;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "s#nO:register_record", const_cast<char**>(kwlist),
+                                   &tag, &tag_size, &arity, &factory)) {
+        return NULL;
+    }
+
+    if(arity < 1 || arity > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "arity must count the tag and fit in a tuple");
+        return NULL;
+    }
+
+    if(tag_size > UINT16_MAX) {
+        PyErr_SetString(PyExc_ValueError, "tag is too big to be an atom");
+        return NULL;
+    }
+
+    record_entry record;
+    record.tag.assign(tag, tag_size);
+    record.arity = arity;
+    record.factory = factory;
+    record.fill_tuple = false;
+
+    if(factory != Py_None) {
+        if(!PyCallable_Check(factory)) {
+            PyErr_SetString(PyExc_TypeError, "factory must be a class or callable");
+            return NULL;
+        }
+
+        if(PyType_Check(factory) && PyType_IsSubtype(reinterpret_cast<PyTypeObject*>(factory), &PyTuple_Type)) {
+            PyObject* fields = PyObject_GetAttrString(factory, "_fields");
+            if(fields == NULL) {
+                PyErr_Clear();
+            }
+            else {
+                Py_ssize_t count = PyObject_Size(fields);
+                Py_DECREF(fields);
+                if(count < 0) {
+                    return NULL;
+                }
+
+                if(count != arity - 1) {
+                    return PyErr_Format(PyExc_ValueError, "%.200s has %zd fields but the record has %zd",
+                                        reinterpret_cast<PyTypeObject*>(factory)->tp_name, count, arity - 1);
+                }
+                record.fill_tuple = true;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < records.size(); ++i) {
+        if(records[i].arity == arity && records[i].tag == record.tag) {
+            PyObject* old = records[i].factory;
+            if(factory == Py_None) {
+                records.erase(records.begin() + i);
+            }
+            else {
+                Py_INCREF(factory);
+                records[i] = record;
+            }
+            Py_DECREF(old);
+            Py_RETURN_NONE;
+        }
+    }
+
+    if(factory != Py_None) {
+        Py_INCREF(factory);
+        records.push_back(record);
+    }
+    Py_RETURN_NONE;
+}
+
+// replaces paths that were not found with the default, or raises KeyError without one
+static PyObject* fill_missing(PyObject* results, PyObject* paths, PyObject* default_value) {
+    for(Py_ssize_t index = 0; index < PyTuple_GET_SIZE(results); ++index) {
+        if(PyTuple_GET_ITEM(results, index) != NULL) {
+            continue;
+        }
+
+        if(default_value == NULL) {
+            PyErr_SetObject(PyExc_KeyError, PyTuple_GET_ITEM(paths, index));
+            Py_DECREF(results);
+            return NULL;
+        }
+        Py_INCREF(default_value);
+        PyTuple_SET_ITEM(results, index, default_value);
+    }
+    return results;
+}
+
+static PyObject* earl_peek(PyObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+    static const char* const kwlist[] = { "data", "path", "default", "span", EARL_UNPACK_OPTIONS, NULL };
+    PyObject* values[6];
+    bool span = false;
+    unpack_options options;
+    Py_buffer buf;
+
+    if(!parse_fastcall("peek", kwlist, 3, 2, args, nargs, kwnames, values) ||
+       !read_flag(values[3], &span) || !read_unpack_options(values + 4, options)) {
+        return NULL;
+    }
+
+    PyObject* path = values[1];
+    PyObject* default_value = values[2];
+    if(PyObject_GetBuffer(values[0], &buf, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    unpacker p(buf, options);
+    match_plan plan;
+    plan.spans = span;
+    if(plan.add_path(path)) {
+        return NULL;
+    }
+
+    PyObject* results = p.match(plan);
+    if(results == NULL) {
+        return NULL;
+    }
+
+    PyObject* value = PyTuple_GET_ITEM(results, 0);
+    if(value == NULL) {
+        Py_DECREF(results);
+        if(default_value == NULL) {
+            PyErr_SetObject(PyExc_KeyError, path);
+            return NULL;
+        }
+        Py_INCREF(default_value);
+        return default_value;
+    }
+
+    Py_INCREF(value);
+    Py_DECREF(results);
+    return value;
+}
+
+// the compiled form of peek, for routing many messages on the same keys
+struct earl_Matcher {
+    PyObject_HEAD
+    match_plan* plan;
+    PyObject* paths;
+    std::string* encoding; // NULL when STRING_EXT stays as bytes
+    unpack_options options;
+};
+
+static PyObject* Matcher_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "paths", "spans", "encoding", "encode_binary_ext", NULL };
+    PyObject* paths;
+    int spans = 0;
+    const char* encoding = NULL;
+    Py_ssize_t len;
+    int encode_binary_ext = 0;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$ps#i:Matcher", const_cast<char**>(kwlist),
+                                   &paths, &spans, &encoding, &len, &encode_binary_ext)) {
+        return NULL;
+    }
+
+    earl_Matcher* self = reinterpret_cast<earl_Matcher*>(type->tp_alloc(type, 0));
+    if(self == NULL) {
+        return NULL;
+    }
+
+    self->paths = PySequence_Tuple(paths);
+    if(self->paths == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    self->plan = new match_plan();
+    self->plan->spans = spans;
+    self->options.encode_binary_ext = encode_binary_ext;
+    if(encoding != NULL) {
+        self->encoding = new std::string(encoding, len);
+        self->options.set_encoding(self->encoding->c_str());
+    }
+
+    for(Py_ssize_t index = 0; index < PyTuple_GET_SIZE(self->paths); ++index) {
+        if(self->plan->add_path(PyTuple_GET_ITEM(self->paths, index))) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void Matcher_dealloc(earl_Matcher* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    delete self->plan;
+    delete self->encoding;
+    Py_XDECREF(self->paths);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject* Matcher_match(earl_Matcher* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "data", "default", NULL };
+    PyObject* default_value = Py_None;
+    Py_buffer buf;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|O:match", const_cast<char**>(kwlist),
+                                   &buf, &default_value)) {
+        return NULL;
+    }
+
+    unpacker p(buf, self->options);
+    PyObject* results = p.match(*self->plan);
+    if(results == NULL) {
+        return NULL;
+    }
+    return fill_missing(results, self->paths, default_value);
+}
+
+static char Matcher_match_docs[] = "match(data, default=None)\n"
+                                   "Returns a tuple with the value (or span) found for each path, in the\n"
+                                   "order the paths were given. Paths that are not present get default.";
+
+static PyMethodDef Matcher_methods[] = {
+    {"match", (PyCFunction)Matcher_match, METH_VARARGS | METH_KEYWORDS, Matcher_match_docs},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Matcher_members[] = {
+    {const_cast<char*>("paths"), T_OBJECT_EX, offsetof(earl_Matcher, paths), READONLY, NULL},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static char Matcher_docs[] = "Matcher(paths, *, spans=False, encoding=None, encode_binary_ext=False)\n"
+                             "A compiled set of peek paths. Every call to match walks the ETF bytes\n"
+                             "once, skipping everything that is not on one of the paths, and stops\n"
+                             "as soon as all of them have been found.";
+
+static PyType_Slot Matcher_slots[] = {
+    {Py_tp_new, reinterpret_cast<void*>(Matcher_new)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(Matcher_dealloc)},
+    {Py_tp_methods, Matcher_methods},
+    {Py_tp_members, Matcher_members},
+    {Py_tp_doc, Matcher_docs},
+    {0, NULL}
+};
+
+static PyType_Spec Matcher_spec = {
+    "earl.Matcher",
+    sizeof(earl_Matcher),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    Matcher_slots
+};
+
+static PyObject* KeyCache_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "capacity", "max_key_size", NULL };
+    Py_ssize_t capacity = 4096;
+    Py_ssize_t max_key_size = 64;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|n$n:KeyCache", const_cast<char**>(kwlist),
+                                   &capacity, &max_key_size)) {
+        return NULL;
+    }
+
+    if(capacity < 1 || capacity > (1 << 24) || max_key_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be from 1 to 2**24 and max_key_size not negative");
+        return NULL;
+    }
+
+    earl_KeyCache* self = reinterpret_cast<earl_KeyCache*>(type->tp_alloc(type, 0));
+    if(self == NULL) {
+        return NULL;
+    }
+    self->cache = new key_cache(capacity, max_key_size);
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void KeyCache_dealloc(earl_KeyCache* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    delete self->cache;
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject* KeyCache_stats(earl_KeyCache* self, PyObject* unused) {
+    key_cache* cache = self->cache;
+    return Py_BuildValue("{sKsKsnsnsn}",
+                         "hits", static_cast<unsigned long long>(cache->hits),
+                         "misses", static_cast<unsigned long long>(cache->misses),
+                         "entries", static_cast<Py_ssize_t>(cache->entries),
+                         "capacity", static_cast<Py_ssize_t>(cache->slots.size()),
+                         "max_key_size", static_cast<Py_ssize_t>(cache->max_key_size));
+}
+
+static PyObject* KeyCache_clear(earl_KeyCache* self, PyObject* unused) {
+    self->cache->clear();
+    self->cache->hits = 0;
+    self->cache->misses = 0;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef KeyCache_methods[] = {
+    {"stats", (PyCFunction)KeyCache_stats, METH_NOARGS, "Returns the hit and miss counts and the size of the cache as a dict."},
+    {"clear", (PyCFunction)KeyCache_clear, METH_NOARGS, "Drops every cached key and resets the counts."},
+    {NULL, NULL, 0, NULL}
+};
+
+static char KeyCache_docs[] = "KeyCache(capacity=4096, *, max_key_size=64)\n"
+                              "Decoded map keys to share between unpack calls. STRING_EXT and BINARY_EXT\n"
+                              "map keys of up to max_key_size bytes that are being decoded as UTF-8\n"
+                              "are looked up by their bytes and come back as the same str object,\n"
+                              "with its hash already known. The table holds capacity keys, rounded up\n"
+                              "to a power of two, in buckets of four. A newer key takes the place of an\n"
+                              "older one in a full bucket.";
+
+static PyType_Slot KeyCache_slots[] = {
+    {Py_tp_new, reinterpret_cast<void*>(KeyCache_new)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(KeyCache_dealloc)},
+    {Py_tp_methods, KeyCache_methods},
+    {Py_tp_doc, KeyCache_docs},
+    {0, NULL}
+};
+
+static PyType_Spec KeyCache_spec = {
+    "earl.KeyCache",
+    sizeof(earl_KeyCache),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    KeyCache_slots
+};
+
+static PyObject* DedupeTable_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "capacity", "max_span", NULL };
+    Py_ssize_t capacity = 65536;
+    Py_ssize_t max_span = 256;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|n$n:DedupeTable", const_cast<char**>(kwlist),
+                                   &capacity, &max_span)) {
+        return NULL;
+    }
+
+    if(capacity < 1 || capacity > (1 << 24) || max_span < 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be from 1 to 2**24 and max_span not negative");
+        return NULL;
+    }
+
+    earl_DedupeTable* self = reinterpret_cast<earl_DedupeTable*>(type->tp_alloc(type, 0));
+    if(self == NULL) {
+        return NULL;
+    }
+    self->table = new dedupe_table(capacity, max_span);
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void DedupeTable_dealloc(earl_DedupeTable* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    delete self->table;
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject* DedupeTable_stats(earl_DedupeTable* self, PyObject* unused) {
+    dedupe_table* table = self->table;
+    return Py_BuildValue("{sKsKsnsnsnsK}",
+                         "hits", static_cast<unsigned long long>(table->hits),
+                         "misses", static_cast<unsigned long long>(table->misses),
+                         "entries", static_cast<Py_ssize_t>(table->entries),
+                         "capacity", static_cast<Py_ssize_t>(table->slots.size()),
+                         "max_span", static_cast<Py_ssize_t>(table->max_span),
+                         "bytes_saved", static_cast<unsigned long long>(table->saved));
+}
+
+static PyObject* DedupeTable_clear(earl_DedupeTable* self, PyObject* unused) {
+    self->table->clear();
+    self->table->hits = 0;
+    self->table->misses = 0;
+    self->table->saved = 0;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef DedupeTable_methods[] = {
+    {"stats", (PyCFunction)DedupeTable_stats, METH_NOARGS, "Returns the hit and miss counts, the size of the table and the bytes saved as a dict."},
+    {"clear", (PyCFunction)DedupeTable_clear, METH_NOARGS, "Drops every shared term and resets the counts."},
+    {NULL, NULL, 0, NULL}
+};
+
+static char DedupeTable_docs[] = "DedupeTable(capacity=65536, *, max_span=256)\n"
+                                 "Immutable terms to share between unpack calls. A bytes, str, float, int\n"
+                                 "outside of -5 to 256, or tuple of these whose encoding takes up to\n"
+                                 "max_span bytes is looked up by that encoding, and an identical one\n"
+                                 "decodes to the same object. The table holds capacity terms, rounded up\n"
+                                 "to a power of two, in buckets of four, and a newer term takes the place\n"
+                                 "of an older one in a full bucket. bytes_saved in stats() is what the\n"
+                                 "shared objects would have taken up as copies, by their __sizeof__.\n"
+                                 "The same bytes decode differently under another encoding, so a table\n"
+                                 "keeps to the encoding options it was first used with. Using it with\n"
+                                 "others raises ValueError until it is cleared.";
+
+static PyType_Slot DedupeTable_slots[] = {
+    {Py_tp_new, reinterpret_cast<void*>(DedupeTable_new)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(DedupeTable_dealloc)},
+    {Py_tp_methods, DedupeTable_methods},
+    {Py_tp_doc, DedupeTable_docs},
+    {0, NULL}
+};
+
+static PyType_Spec DedupeTable_spec = {
+    "earl.DedupeTable",
+    sizeof(earl_DedupeTable),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    DedupeTable_slots
+};
+
+static PyObject* Chunk_repr(PyObject* self) {
+    return PyUnicode_FromString("earl.CHUNK");
+}
+
+static PyType_Slot Chunk_slots[] = {
+    {Py_tp_repr, reinterpret_cast<void*>(Chunk_repr)},
+    {Py_tp_doc, const_cast<char*>("The type of earl.CHUNK, the placeholder for the elements in a pack_chunked envelope.")},
+    {0, NULL}
+};
+
+static PyType_Spec Chunk_spec = {
+    "earl.Chunk",
+    sizeof(PyObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    Chunk_slots
+};
+
+// pack and unpack with options parsed once, reusing one output buffer between calls
+struct earl_Codec {
+    PyObject_HEAD
+    PyObject* encoding;     // keeps the option strings alive
+    PyObject* encode_mode;
+    PyObject* encode_binary_ext;
+    PyObject* key_cache;    // keeps unpack.keys alive
+    pack_options pack;
+    unpack_options unpack;
+    bool validate;
+    packer* scratch;
+    bool packing;           // set while scratch is in use, in case __reduce__ or a property packs again
+};
+
+static PyObject* Codec_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "encoding", "encode_mode", "encode_binary_ext", "namedtuple_as_record",
+                                    "enum_as_atom", "deterministic", "validate", "key_cache", NULL };
+    PyObject* encoding = Py_None;
+    int encode_mode = encode_type::bytes;
+    int encode_binary_ext = 0;
+    int namedtuple_as_record = 0;
+    int enum_as_atom = 0;
+    int deterministic = 0;
+    int validate = 0;
+    PyObject* keys = Py_None;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|O$ipppppO:Codec", const_cast<char**>(kwlist), &encoding, &encode_mode,
+                                   &encode_binary_ext, &namedtuple_as_record, &enum_as_atom, &deterministic, &validate, &keys)) {
+        return NULL;
+    }
+
+    if(encoding != Py_None && !PyUnicode_Check(encoding)) {
+        PyErr_Format(PyExc_TypeError, "encoding must be a str or None, not %.200s", Py_TYPE(encoding)->tp_name);
+        return NULL;
+    }
+
+    key_cache* cache = NULL;
+    if(!read_key_cache(keys, &cache)) {
+        return NULL;
+    }
+
+    earl_Codec* self = reinterpret_cast<earl_Codec*>(type->tp_alloc(type, 0));
+    if(self == NULL) {
+        return NULL;
+    }
+
+    new (&self->pack) pack_options();
+    new (&self->unpack) unpack_options();
+    Py_INCREF(keys);
+    self->key_cache = keys;
+    self->unpack.keys = cache;
+    Py_INCREF(encoding);
+    self->encoding = encoding;
+    self->encode_mode = PyLong_FromLong(encode_mode);
+    self->encode_binary_ext = PyBool_FromLong(encode_binary_ext);
+    if(self->encode_mode == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    if(encoding != Py_None) {
+        const char* name = PyUnicode_AsUTF8(encoding);
+        if(name == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->pack.set_encoding(name);
+        self->unpack.set_encoding(name);
+    }
+
+    self->pack.encode_mode = encode_mode;
+    self->pack.namedtuple_as_record = namedtuple_as_record;
+    self->pack.enum_as_atom = enum_as_atom;
+    self->pack.deterministic = deterministic;
+    self->unpack.encode_binary_ext = encode_binary_ext;
+    self->validate = validate;
+    self->scratch = new packer(self->pack);
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void Codec_dealloc(earl_Codec* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    delete self->scratch;
+    Py_XDECREF(self->encoding);
+    Py_XDECREF(self->encode_mode);
+    Py_XDECREF(self->encode_binary_ext);
+    Py_XDECREF(self->key_cache);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject* Codec_pack(earl_Codec* self, PyObject* const* args, Py_ssize_t nargs) {
+    if(nargs != 1) {
+        PyErr_Format(PyExc_TypeError, "pack() takes exactly one argument (%zd given)", nargs);
+        return NULL;
+    }
+
+    if(self->packing) {
+        packer p(self->pack);
+        return p.pack(args[0]);
+    }
+
+    self->packing = true;
+    PyObject* ret = self->scratch->pack(args[0]);
+    self->scratch->trim();
+    self->packing = false;
+    return ret;
+}
+
+static PyObject* Codec_unpack(earl_Codec* self, PyObject* const* args, Py_ssize_t nargs) {
+    Py_buffer buf;
+    if(nargs != 1) {
+        PyErr_Format(PyExc_TypeError, "unpack() takes exactly one argument (%zd given)", nargs);
+        return NULL;
+    }
+
+    if(PyObject_GetBuffer(args[0], &buf, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    unpacker p(buf, self->unpack);
+    return p.unpack(self->validate);
+}
+
+static char Codec_pack_docs[] = "pack(obj)\n"
+                                "Same as earl.pack with the options of this codec.";
+
+static char Codec_unpack_docs[] = "unpack(data)\n"
+                                  "Same as earl.unpack with the options of this codec.";
+
+static PyMethodDef Codec_methods[] = {
+    {"pack", (PyCFunction)(void(*)(void))Codec_pack, METH_FASTCALL, Codec_pack_docs},
+    {"unpack", (PyCFunction)(void(*)(void))Codec_unpack, METH_FASTCALL, Codec_unpack_docs},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Codec_members[] = {
+    {const_cast<char*>("encoding"), T_OBJECT_EX, offsetof(earl_Codec, encoding), READONLY, NULL},
+    {const_cast<char*>("encode_mode"), T_OBJECT_EX, offsetof(earl_Codec, encode_mode), READONLY, NULL},
+    {const_cast<char*>("encode_binary_ext"), T_OBJECT_EX, offsetof(earl_Codec, encode_binary_ext), READONLY, NULL},
+    {const_cast<char*>("key_cache"), T_OBJECT_EX, offsetof(earl_Codec, key_cache), READONLY, NULL},
+    {NULL, 0, 0, 0, NULL}
+};
+
+static char Codec_docs[] = "Codec(encoding=None, *, encode_mode=ENCODE_AS_BYTES, encode_binary_ext=False,\n"
+                           "      namedtuple_as_record=False, enum_as_atom=False, deterministic=False,\n"
+                           "      validate=False, key_cache=None)\n"
+                           "Packs and unpacks with a fixed set of options, for hot loops that would\n"
+                           "otherwise pass the same keywords on every call. The encoding is used for\n"
+                           "both directions; None packs str as utf-8 and leaves STRING_EXT as bytes.\n"
+                           "pack reuses its output buffer from call to call.";
+
+static PyType_Slot Codec_slots[] = {
+    {Py_tp_new, reinterpret_cast<void*>(Codec_new)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(Codec_dealloc)},
+    {Py_tp_methods, Codec_methods},
+    {Py_tp_members, Codec_members},
+    {Py_tp_doc, Codec_docs},
+    {0, NULL}
+};
+
+static PyType_Spec Codec_spec = {
+    "earl.Codec",
+    sizeof(earl_Codec),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    Codec_slots
+};
+
+// a single producer, single consumer ring of frames that lives in a buffer shared
+// between processes. head and tail only ever grow, positions wrap around capacity.
+struct ring_header {
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t reserved0[6];
+    uint64_t head;          // written by the producer
+    uint64_t pushed;
+    uint64_t reserved1[6];
+    uint64_t tail;          // written by the consumer
+    uint64_t popped;
+    uint64_t popped_bytes;
+    uint64_t reserved2[5];
+    uint64_t closed;
+    uint64_t reserved3[7];
+};
+
+// every frame starts with this, followed by the payload padded to 8 bytes
+struct ring_record {
+    uint32_t length;
+    uint32_t flags;
+    uint64_t tag;
+};
+
+const uint64_t RING_MAGIC = 0x474e49524c524145ULL; // "EARLRING"
+const uint32_t RING_WRAP = 1;
+
+static uint64_t ring_load(const uint64_t* value) {
+    return reinterpret_cast<const std::atomic<uint64_t>*>(value)->load(std::memory_order_acquire);
+}
+
+static void ring_store(uint64_t* value, uint64_t integer) {
+    reinterpret_cast<std::atomic<uint64_t>*>(value)->store(integer, std::memory_order_release);
+}
+
+static uint64_t ring_record_size(uint64_t length) {
+    return sizeof(ring_record) + ((length + 7) & ~static_cast<uint64_t>(7));
+}
+
+struct earl_Ring {
+    PyObject_HEAD
+    Py_buffer view;
+    ring_header* header;    // NULL once released
+    char* data;
+    uint64_t capacity;
+    Py_ssize_t unpacking;   // unpack calls in progress, which may run Python code that releases us
+};
 
-    PyObject* atom_ext() {
-        const char* len_bytes = range(2);
-        if(len_bytes == NULL) {
-            return NULL;
-        }
-        uint16_t length = from_big_endian<uint16_t>(len_bytes);
-        return convert_atom(length);
-    }
+static PyObject* Ring_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "buffer", "create", NULL };
+    PyObject* buffer;
+    int create = 0;
 
-    PyObject* small_atom_ext() {
-        EARL_GET_UNROLLED(length);
-        return convert_atom(length);
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$p:Ring", const_cast<char**>(kwlist), &buffer, &create)) {
+        return NULL;
     }
 
-    PyObject* convert_atom(Py_ssize_t length) {
-        const char* atom = range(length);
-        if(atom == NULL) {
-            return NULL;
-        }
-
-        if(length >= 3 && length <= 5) {
-            if(length == 3 && strncmp(atom, "nil", 3) == 0) {
-                Py_RETURN_NONE;
-            }
-            else if(length == 4 && strncmp(atom, "true", 4) == 0) {
-                Py_RETURN_TRUE;
-            }
-            else if(length == 5 && strncmp(atom, "false", 5) == 0) {
-                Py_RETURN_FALSE;
-            }
-        }
+    earl_Ring* self = reinterpret_cast<earl_Ring*>(type->tp_alloc(type, 0));
+    if(self == NULL) {
+        return NULL;
+    }
 
-        // we return atoms as UTF-8 encoded unicode strings
-        return PyUnicode_DecodeUTF8(atom, length, NULL);
+    if(PyObject_GetBuffer(buffer, &self->view, PyBUF_WRITABLE) < 0) {
+        Py_DECREF(self);
+        return NULL;
     }
 
-    PyObject* nil_ext() {
-        return PyList_New(0); // empty list
+    ring_header* header = reinterpret_cast<ring_header*>(self->view.buf);
+    self->header = header;
+    if(reinterpret_cast<uintptr_t>(header) % 8 != 0 || self->view.len < static_cast<Py_ssize_t>(sizeof(ring_header)) + 64) {
+        PyErr_SetString(PyExc_ValueError, "ring buffers must be 8 byte aligned and hold at least 320 bytes");
+        Py_DECREF(self);
+        return NULL;
     }
 
-    PyObject* small_tuple_ext() {
-        EARL_GET_UNROLLED(length);
-        return create_tuple(length);
+    uint64_t available = (self->view.len - sizeof(ring_header)) & ~static_cast<uint64_t>(7);
+    if(create) {
+        memset(header, 0, sizeof(ring_header));
+        header->capacity = available;
+        ring_store(&header->magic, RING_MAGIC);
+    }
+    else if(ring_load(&header->magic) != RING_MAGIC || header->capacity > available) {
+        PyErr_SetString(PyExc_ValueError, "buffer does not hold a ring");
+        Py_DECREF(self);
+        return NULL;
     }
 
-    PyObject* large_tuple_ext() {
-        EARL_GET_LENGTH
-        return create_tuple(length);
+    self->capacity = header->capacity;
+    self->data = reinterpret_cast<char*>(header + 1);
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void Ring_release_buffer(earl_Ring* self) {
+    if(self->view.obj != NULL) {
+        PyBuffer_Release(&self->view);
     }
+    self->header = NULL;
+}
 
-    PyObject* create_tuple(Py_ssize_t length) {
-        PyObject* tuple = PyTuple_New(length);
-        if(tuple == NULL) {
-            return NULL;
-        }
+static void Ring_dealloc(earl_Ring* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    Ring_release_buffer(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
 
-        for(Py_ssize_t i = 0; i < length; ++i) {
-            PyObject* element = decode();
-            if(element == NULL) {
-                Py_DECREF(tuple);
-                return NULL;
-            }
-            PyTuple_SET_ITEM(tuple, i, element);
-        }
-        return tuple;
+static bool Ring_check(earl_Ring* self) {
+    if(self->header == NULL) {
+        PyErr_SetString(PyExc_ValueError, "ring has been released");
+        return false;
     }
+    return true;
+}
 
-    PyObject* list_ext() {
-        EARL_GET_LENGTH
-        PyObject* list = PyList_New(length);
-        if(list == NULL) {
-            return NULL;
+// finds the next frame for the consumer, or returns NULL if there is none
+static ring_record* Ring_front(earl_Ring* self) {
+    ring_header* header = self->header;
+    uint64_t tail = header->tail;
+    uint64_t head = ring_load(&header->head);
+    while(tail != head) {
+        uint64_t position = tail % self->capacity;
+        uint64_t to_end = self->capacity - position;
+        ring_record* record = reinterpret_cast<ring_record*>(self->data + position);
+        if(to_end < sizeof(ring_record) || record->flags == RING_WRAP) {
+            tail += to_end;
+            ring_store(&header->tail, tail);
+            continue;
         }
+        return record;
+    }
+    return NULL;
+}
 
-        for(Py_ssize_t i = 0; i < length; ++i) {
-            PyObject* element = decode();
-            if(element == NULL) {
-                Py_DECREF(list);
-                return NULL;
-            }
-            PyList_SET_ITEM(list, i, element);
-        }
+static void Ring_pop(earl_Ring* self, ring_record* record) {
+    ring_header* header = self->header;
+    uint32_t length = record->length;
+    ring_store(&header->popped, header->popped + 1);
+    ring_store(&header->popped_bytes, header->popped_bytes + length);
+    ring_store(&header->tail, header->tail + ring_record_size(length));
+}
 
-        EARL_GET_UNROLLED(op);
-        if(op != NIL_EXT) {
-            PyErr_SetString(earl_DecodeError, "Expected NIL_EXT after list but did not receive one");
-            Py_DECREF(list);
-            return NULL;
-        }
-        return list;
+static PyObject* Ring_put(earl_Ring* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "data", "tag", NULL };
+    Py_buffer frame;
+    unsigned long long tag = 0;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|K:put", const_cast<char**>(kwlist), &frame, &tag)) {
+        return NULL;
     }
 
-    PyObject* string_ext() {
-        const char* len = range(2);
-        if(len == NULL) {
-            return NULL;
-        }
-        uint16_t length = from_big_endian<uint16_t>(len);
-        const char* string_bytes = range(length);
-        if(string_bytes == NULL) {
-            return NULL;
-        }
+    if(!Ring_check(self)) {
+        PyBuffer_Release(&frame);
+        return NULL;
+    }
 
-        if(encoding == NULL) {
-            // no encoding, so just return a bytes object
-            return PyBytes_FromStringAndSize(string_bytes, length);
-        }
+    uint64_t size = ring_record_size(frame.len);
+    if(frame.len > UINT32_MAX || size > self->capacity) {
+        PyBuffer_Release(&frame);
+        PyErr_SetString(PyExc_ValueError, "frame is bigger than the ring");
+        return NULL;
+    }
+
+    ring_header* header = self->header;
+    uint64_t head = header->head;
+    uint64_t tail = ring_load(&header->tail);
+    uint64_t position = head % self->capacity;
+    uint64_t to_end = self->capacity - position;
 
-        return PyUnicode_Decode(string_bytes, length, encoding, "strict");
+    // frames are never split, so skip to the start if this one doesn't fit before the end
+    uint64_t padding = to_end < size ? to_end : 0;
+    if(head + padding + size - tail > self->capacity) {
+        PyBuffer_Release(&frame);
+        Py_RETURN_FALSE;
     }
 
-    PyObject* binary_ext() {
-        EARL_GET_LENGTH
-        const char* string_bytes = range(length);
-        if(string_bytes == NULL) {
-            return NULL;
-        }
-        if(!encode_binary_ext || encoding == NULL) {
-            return PyBytes_FromStringAndSize(string_bytes, length);
+    if(padding) {
+        if(padding >= sizeof(ring_record)) {
+            reinterpret_cast<ring_record*>(self->data + position)->flags = RING_WRAP;
         }
-        return PyUnicode_Decode(string_bytes, length, encoding, "strict");
+        position = 0;
     }
 
-    PyObject* map_ext() {
-        EARL_GET_LENGTH
-        PyObject* dict = PyDict_New();
-        if(dict == NULL) {
-            return NULL;
-        }
+    ring_record* record = reinterpret_cast<ring_record*>(self->data + position);
+    record->length = frame.len;
+    record->flags = 0;
+    record->tag = tag;
+    memcpy(record + 1, frame.buf, frame.len);
+    PyBuffer_Release(&frame);
 
-        for(Py_ssize_t i = 0; i < length; ++i) {
-            PyObject* key = decode();
-            if(key == NULL) {
-                PyDict_Clear(dict);
-                Py_DECREF(dict);
-                return NULL;
-            }
+    ring_store(&header->pushed, header->pushed + 1);
+    ring_store(&header->head, head + padding + size);
+    Py_RETURN_TRUE;
+}
 
-            PyObject* value = decode();
-            if(value == NULL) {
-                Py_DECREF(key);
-                PyDict_Clear(dict);
-                Py_DECREF(dict);
-                return NULL;
-            }
+static PyObject* Ring_take(earl_Ring* self, PyObject* args) {
+    PyObject* default_value = Py_None;
+    if(!PyArg_ParseTuple(args, "|O:take", &default_value)) {
+        return NULL;
+    }
 
-            int ret = PyDict_SetItem(dict, key, value);
-            Py_DECREF(key);
-            Py_DECREF(value);
+    if(!Ring_check(self)) {
+        return NULL;
+    }
 
-            if(ret < 0) {
-                PyDict_Clear(dict);
-                Py_DECREF(dict);
-                return NULL;
-            }
-        }
+    ring_record* record = Ring_front(self);
+    if(record == NULL) {
+        Py_INCREF(default_value);
+        return default_value;
+    }
 
-        return dict;
+    PyObject* ret = Py_BuildValue("(Ky#)", static_cast<unsigned long long>(record->tag),
+                                  reinterpret_cast<const char*>(record + 1), static_cast<Py_ssize_t>(record->length));
+    if(ret != NULL) {
+        Ring_pop(self, record);
     }
+    return ret;
+}
 
-    PyObject* compressed() {
-        EARL_GET_LENGTH
-        PyObject* zlib = PyImport_ImportModule("zlib");
-        if(zlib == NULL) {
-            return NULL;
-        }
+static PyObject* Ring_unpack(earl_Ring* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = { "default", "matcher", "encoding", "encode_binary_ext", NULL };
+    PyObject* default_value = Py_None;
+    PyObject* matcher = Py_None;
+    const char* encoding = NULL;
+    Py_ssize_t len;
+    int encode_binary_ext = 0;
 
-        PyObject* decompress = PyObject_GetAttrString(zlib, "decompress");
-        if(decompress == NULL) {
-            Py_DECREF(zlib);
-            return NULL;
-        }
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|O$Os#i:unpack", const_cast<char**>(kwlist),
+                                   &default_value, &matcher, &encoding, &len, &encode_binary_ext)) {
+        return NULL;
+    }
 
-        PyObject* bytes_obj = PyBytes_FromStringAndSize(&bytes[offset], buf.len - offset);
-        if(bytes_obj == NULL) {
-            Py_DECREF(decompress);
-            Py_DECREF(zlib);
-            return NULL;
-        }
+    if(matcher != Py_None && !PyObject_TypeCheck(matcher, reinterpret_cast<PyTypeObject*>(matcher_type))) {
+        PyErr_SetString(PyExc_TypeError, "matcher must be an earl.Matcher");
+        return NULL;
+    }
 
-        PyObject* wbits = PyLong_FromLong(15L);
-        PyObject* py_length = PyLong_FromUnsignedLong(length);
-        PyObject* args = Py_BuildValue("(OOO)", bytes_obj, wbits, py_length);
-        Py_DECREF(bytes_obj);
-        if(args == NULL) {
-            Py_XDECREF(py_length);
-            Py_DECREF(wbits);
-            Py_DECREF(decompress);
-            Py_DECREF(zlib);
-            return NULL;
-        }
+    if(!Ring_check(self)) {
+        return NULL;
+    }
 
-        PyObject* new_bytes = PyEval_CallObject(decompress, args);
-        Py_DECREF(wbits);
-        Py_DECREF(py_length);
-        Py_DECREF(args);
-        if(new_bytes == NULL) {
-            return NULL;
-        }
+    ring_record* record = Ring_front(self);
+    if(record == NULL) {
+        Py_INCREF(default_value);
+        return default_value;
+    }
 
-        Py_buffer buffer;
-        if(PyObject_GetBuffer(new_bytes, &buffer, PyBUF_C_CONTIGUOUS) < 0) {
-            Py_DECREF(new_bytes);
-            Py_DECREF(decompress);
-            Py_DECREF(zlib);
-            return NULL;
+    // decode straight out of the shared buffer, the view keeps us alive meanwhile and
+    // release() refuses to unmap it
+    Py_buffer view;
+    if(PyBuffer_FillInfo(&view, reinterpret_cast<PyObject*>(self), record + 1, record->length, 1, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    ++self->unpacking;
+
+    PyObject* value;
+    if(matcher == Py_None) {
+        unpack_options options;
+        options.set_encoding(encoding);
+        options.encode_binary_ext = encode_binary_ext;
+        unpacker p(view, options);
+        value = p.unpack();
+    }
+    else {
+        earl_Matcher* m = reinterpret_cast<earl_Matcher*>(matcher);
+        unpacker p(view, m->options);
+        value = p.match(*m->plan);
+        if(value != NULL) {
+            value = fill_missing(value, m->paths, Py_None);
         }
+    }
 
-        // replace ourselves with the new buffer
-        this->~unpacker();
-        new(this) unpacker(buffer, encoding, encode_binary_ext);
-        PyObject* ret = decode();
-        Py_DECREF(new_bytes);
-        Py_DECREF(decompress);
-        Py_DECREF(zlib);
-        return ret;
+    --self->unpacking;
+    uint64_t tag = record->tag;
+    // bad frames are dropped too so they can't wedge the ring
+    Ring_pop(self, record);
+    if(value == NULL) {
+        // but let the caller know which frame it was
+        PyObject* type;
+        PyObject* error;
+        PyObject* traceback;
+        PyErr_Fetch(&type, &error, &traceback);
+        PyErr_NormalizeException(&type, &error, &traceback);
+        PyObject* py_tag = PyLong_FromUnsignedLongLong(tag);
+        if(error != NULL && py_tag != NULL && PyObject_SetAttrString(error, "tag", py_tag) < 0) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(py_tag);
+        PyErr_Restore(type, error, traceback);
+        return NULL;
     }
-};
 
-#undef EARL_GET_UNROLLED
-#undef EARL_GET_LENGTH
+    PyObject* ret = Py_BuildValue("(KN)", static_cast<unsigned long long>(tag), value);
+    return ret;
+}
 
-static PyObject* earl_pack(PyObject* self, PyObject* args, PyObject* kwargs) {
-    PyObject* to_pack;
-    int encode_mode = encode_type::bytes;
-    const char* encoding = "utf-8";
-    size_t len;
+static PyObject* Ring_close(earl_Ring* self, PyObject* unused) {
+    if(!Ring_check(self)) {
+        return NULL;
+    }
+    ring_store(&self->header->closed, 1);
+    Py_RETURN_NONE;
+}
 
-    static const char* kwlist[] = { "obj", "encoding", "encode_mode", NULL };
+static PyObject* Ring_release(earl_Ring* self, PyObject* unused) {
+    if(self->unpacking > 0) {
+        PyErr_SetString(PyExc_BufferError, "ring can't be released while a frame is being unpacked from it");
+        return NULL;
+    }
+    Ring_release_buffer(self);
+    Py_RETURN_NONE;
+}
 
-    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$s#i:pack", const_cast<char**>(kwlist),
-                                   &to_pack, &encoding, &len, &encode_mode)) {
+static PyObject* Ring_stats(earl_Ring* self, PyObject* unused) {
+    if(!Ring_check(self)) {
         return NULL;
     }
 
-    packer p(encoding, encode_mode);
-    PyObject* ret = p.pack(to_pack);
-    return ret;
+    ring_header* header = self->header;
+    uint64_t pushed = ring_load(&header->pushed);
+    uint64_t popped = ring_load(&header->popped);
+    uint64_t head = ring_load(&header->head);
+    uint64_t tail = ring_load(&header->tail);
+    return Py_BuildValue("{sKsKsKsKsKsK}",
+                         "capacity", static_cast<unsigned long long>(self->capacity),
+                         "pushed", static_cast<unsigned long long>(pushed),
+                         "popped", static_cast<unsigned long long>(popped),
+                         "popped_bytes", static_cast<unsigned long long>(ring_load(&header->popped_bytes)),
+                         "pending_frames", static_cast<unsigned long long>(pushed >= popped ? pushed - popped : 0),
+                         "pending_bytes", static_cast<unsigned long long>(head >= tail ? head - tail : 0));
 }
 
-static PyObject* earl_unpack(PyObject* self, PyObject* args, PyObject* kwargs) {
-    static const char* kwlist[] = { "data", "encoding", "encode_binary_ext", NULL };
-    const char* encoding = NULL;
-    size_t len;
-    int encode_binary_ext = 0;
-    Py_buffer buf;
-
-    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|$s#i", const_cast<char**>(kwlist),
-                                   &buf, &encoding, &len, &encode_binary_ext)) {
+static PyObject* Ring_get_closed(earl_Ring* self, void* unused) {
+    if(!Ring_check(self)) {
         return NULL;
     }
+    return PyBool_FromLong(ring_load(&self->header->closed) != 0);
+}
 
-    unpacker p(buf, encoding, encode_binary_ext);
-    PyObject* unpacked = p.unpack();
-    return unpacked;
+static PyMethodDef Ring_methods[] = {
+    {"put", (PyCFunction)Ring_put, METH_VARARGS | METH_KEYWORDS,
+     "put(data, tag=0)\nCopies a frame into the ring. Returns False if there is no room for it."},
+    {"take", (PyCFunction)Ring_take, METH_VARARGS,
+     "take(default=None)\nReturns the next (tag, bytes) frame, or default if the ring is empty."},
+    {"unpack", (PyCFunction)Ring_unpack, METH_VARARGS | METH_KEYWORDS,
+     "unpack(default=None, *, matcher=None, encoding=None, encode_binary_ext=False)\n"
+     "Decodes the next frame in place and returns (tag, value), or default if the ring is empty.\n"
+     "With a matcher the value is the tuple Matcher.match would return. Frames that fail to\n"
+     "decode are dropped and the error raised has their tag as its tag attribute."},
+    {"close", (PyCFunction)Ring_close, METH_NOARGS, "Tells the consumer no more frames are coming."},
+    {"release", (PyCFunction)Ring_release, METH_NOARGS, "Lets go of the underlying buffer."},
+    {"stats", (PyCFunction)Ring_stats, METH_NOARGS, "Returns the ring's counters as a dict."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef Ring_getset[] = {
+    {const_cast<char*>("closed"), (getter)Ring_get_closed, NULL, NULL, NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static char Ring_docs[] = "Ring(buffer, *, create=False)\n"
+                          "A lock-free ring of ETF frames inside a writable buffer, usually the buf of\n"
+                          "a multiprocessing.shared_memory.SharedMemory. One process puts frames and\n"
+                          "one other process takes or unpacks them; the header is initialised when\n"
+                          "create is True and checked otherwise.";
+
+static PyType_Slot Ring_slots[] = {
+    {Py_tp_new, reinterpret_cast<void*>(Ring_new)},
+    {Py_tp_dealloc, reinterpret_cast<void*>(Ring_dealloc)},
+    {Py_tp_methods, Ring_methods},
+    {Py_tp_getset, Ring_getset},
+    {Py_tp_doc, Ring_docs},
+    {0, NULL}
+};
+
+static PyType_Spec Ring_spec = {
+    "earl.Ring",
+    sizeof(earl_Ring),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    Ring_slots
+};
+
+// the process pool lives in pure Python, loaded the first time it's asked for
+static PyObject* earl_getattr(PyObject* self, PyObject* name) {
+    if(PyUnicode_Check(name) && PyUnicode_CompareWithASCIIString(name, "DecodePool") == 0) {
+        PyObject* pool = PyImport_ImportModule("earl_pool");
+        if(pool == NULL) {
+            return NULL;
+        }
+
+        PyObject* ret = PyObject_GetAttr(pool, name);
+        Py_DECREF(pool);
+        return ret;
+    }
+    return PyErr_Format(PyExc_AttributeError, "module 'earl' has no attribute '%U'", name);
 }
 
-static char earl_pack_docs[] = "pack(value, *, encoding=None, encode_mode=ENCODE_AS_BYTES)\n"
+static char earl_pack_docs[] = "pack(value, *, digest=False, encoding=None, encode_mode=ENCODE_AS_BYTES,\n"
+                              "     deterministic=False)\n"
                               "Packs a value to External Term Format.\n"
                               "The encode_mode parameter is used to set how to encode unicode\n"
                               "strings to ETF. Depending on the mode, the effect changes as follows:\n\n"
@@ -895,16 +5070,94 @@ static char earl_pack_docs[] = "pack(value, *, encoding=None, encode_mode=ENCODE
                               "- ENCODE_AS_ATOM: Encodes the string with ATOM_EXT (or SMALL_ATOM_EXT)\n\n"
                               "When using ENCODE_AS_ATOM the string will be encoded into UTF-8.\n\n"
                               "The encoding parameter denotes how to encode the unicode strings.\n"
-                              "By default, it encodes them into UTF-8.";
-static char earl_unpack_docs[] = "unpack(data, *, encoding=None, encode_binary_ext=False): Unpack ETF data.\n"
+                              "By default, it encodes them into UTF-8.\n\n"
+                              "Dataclasses are packed as maps with atom keys. NamedTuples are packed\n"
+                              "as tuples, or as records tagged with the class name when\n"
+                              "namedtuple_as_record is True. Enum members are packed as their value,\n"
+                              "or as an atom of their name when enum_as_atom is True.\n\n"
+                              "With deterministic set, map entries and set elements are packed in\n"
+                              "Erlang term order so equal values always give the same bytes. With\n"
+                              "digest set, a (bytes, digest) tuple is returned where digest is the\n"
+                              "XXH64 of the bytes, computed while packing.";
+static char earl_pack_chunked_docs[] = "pack_chunked(value, max_bytes, wrap=None, *, encoding=None, encode_mode=ENCODE_AS_BYTES)\n"
+                                      "Packs the elements of an iterable or mapping into a list of terms of at\n"
+                                      "most max_bytes each, cutting between elements, for transports with a\n"
+                                      "frame limit. Each term is a list (or map) holding the next run of\n"
+                                      "elements, every element is packed exactly once.\n\n"
+                                      "wrap is an envelope to put every chunk in, containing earl.CHUNK where\n"
+                                      "the elements go, e.g. {\"op\": 0, \"d\": earl.CHUNK}, or a callable that\n"
+                                      "returns one when given earl.CHUNK. Raises EncodeError if a single\n"
+                                      "element doesn't fit. The other options are the same as for pack.";
+
+static char earl_unpack_docs[] = "unpack(data, *, validate=False, key_cache=None, dedupe=False, encoding=None,\n"
+                                "       encode_binary_ext=False):\n"
+                                "Unpack ETF data.\n"
                                 "The encoding parameter specifies how to decode STRING_EXT data\n"
                                 "if encountered. If no encoding is passed, then STRING_EXT is encoded\n"
                                 "as a bytes object.\n\n If the encode_binary_ext parameter is set to True, "
-                                "then BINARY_EXT is also encoded into the encoding given.";
+                                "then BINARY_EXT is also encoded into the encoding given.\n\n"
+                                "With validate set, the data is checked as by validate() before any\n"
+                                "object is created. A KeyCache given as key_cache is used for map keys\n"
+                                "that are decoded as UTF-8.\n\n"
+                                "With dedupe set, identical immutable terms in the data decode to one\n"
+                                "shared object. dedupe is either a bool or a DedupeTable to share terms\n"
+                                "between calls.";
+
+static char earl_pack_to_docs[] = "pack_to(value, writer, *, chunk_size=65536, compressed=False, digest=False,\n"
+                                 "        encoding=None, encode_mode=ENCODE_AS_BYTES, deterministic=False)\n"
+                                 "Packs a value straight to a file descriptor or an object with a write()\n"
+                                 "method, handing it chunk_size bytes at a time so memory use doesn't grow\n"
+                                 "with the size of the term. Returns the number of bytes written.\n\n"
+                                 "compressed is either a bool or a zlib level from 0 to 9, as in\n"
+                                 "term_to_binary. A compressed term is packed twice: once to measure it\n"
+                                 "for the COMPRESSED_TERM header and once to write it, so it can't hold\n"
+                                 "iterators.\n"
+                                 "Other iterables are packed as lists, which need their length up front,\n"
+                                 "so everything after the start of one is held in memory until it ends.\n"
+                                 "With digest set, (written, digest) is returned, where digest is that of\n"
+                                 "the uncompressed term as pack would give it.\n"
+                                 "The other options are the same as for pack.";
+
+static char earl_pack_iov_docs[] = "pack_iov(value, *, min_ref_size=16384, encoding=None, encode_mode=ENCODE_AS_BYTES)\n"
+                                  "Packs a value into a list of buffers that can be given to socket.sendmsg\n"
+                                  "or os.writev as is. bytes, bytearray and memoryview binaries of at least\n"
+                                  "min_ref_size bytes are referenced in the list instead of being copied,\n"
+                                  "everything else is coalesced into bytes segments.\n"
+                                  "The other options are the same as for pack.";
+
+static char earl_peek_docs[] = "peek(data, path, default=<raise KeyError>, *, span=False, encoding=None, encode_binary_ext=False)\n"
+                              "Returns a single value out of ETF data without unpacking the rest of it.\n"
+                              "The path is a key or a sequence of keys: str, bytes, True, False and None\n"
+                              "select map keys, ints select map keys or tuple and list positions.\n"
+                              "str keys match atom and binary keys alike.\n\n"
+                              "If span is True then a (start, end) tuple of byte offsets into data is\n"
+                              "returned instead, so the raw subterm can be forwarded as is.";
+
+static char earl_validate_docs[] = "validate(data, *, encoding=None, encode_binary_ext=False)\n"
+                                  "Checks that data holds a well formed term without decoding it: every\n"
+                                  "tag and length, that lists end in NIL_EXT and that atoms are UTF-8, as\n"
+                                  "are STRING_EXT and BINARY_EXT when unpack would decode them as UTF-8.\n"
+                                  "Returns the offset just past the term. Otherwise raises DecodeError\n"
+                                  "with a (message, offset) pair pointing at the first bad byte. Offsets\n"
+                                  "in a compressed term are into its uncompressed payload.";
+
+static char earl_register_record_docs[] = "register_record(tag, arity, factory)\n"
+                                         "Decodes tuples of the given arity (counting the tag, as in is_record/3)\n"
+                                         "whose first element is the tag atom by calling factory with the\n"
+                                         "remaining elements. NamedTuple classes are filled in directly and also\n"
+                                         "use the tag when packed with namedtuple_as_record.\n"
+                                         "Passing None as the factory removes the record.";
 
 static PyMethodDef earlmethods[] = {
-    {"pack", (PyCFunction)earl_pack, METH_VARARGS | METH_KEYWORDS, earl_pack_docs},
-    {"unpack", (PyCFunction)earl_unpack, METH_VARARGS | METH_KEYWORDS, earl_unpack_docs},
+    {"pack", (PyCFunction)(void(*)(void))earl_pack, METH_FASTCALL | METH_KEYWORDS, earl_pack_docs},
+    {"pack_to", (PyCFunction)(void(*)(void))earl_pack_to, METH_FASTCALL | METH_KEYWORDS, earl_pack_to_docs},
+    {"pack_iov", (PyCFunction)(void(*)(void))earl_pack_iov, METH_FASTCALL | METH_KEYWORDS, earl_pack_iov_docs},
+    {"pack_chunked", (PyCFunction)(void(*)(void))earl_pack_chunked, METH_FASTCALL | METH_KEYWORDS, earl_pack_chunked_docs},
+    {"unpack", (PyCFunction)(void(*)(void))earl_unpack, METH_FASTCALL | METH_KEYWORDS, earl_unpack_docs},
+    {"peek", (PyCFunction)(void(*)(void))earl_peek, METH_FASTCALL | METH_KEYWORDS, earl_peek_docs},
+    {"validate", (PyCFunction)(void(*)(void))earl_validate, METH_FASTCALL | METH_KEYWORDS, earl_validate_docs},
+    {"register_record", (PyCFunction)earl_register_record, METH_VARARGS | METH_KEYWORDS, earl_register_record_docs},
+    {"__getattr__", (PyCFunction)earl_getattr, METH_O, NULL},
     {NULL, NULL, 0, NULL}
 };
 
@@ -940,6 +5193,46 @@ PyMODINIT_FUNC PyInit_earl() {
         goto error;
     }
 
+    if(PyModule_AddObject(mod, "Ring", PyType_FromSpec(&Ring_spec))) {
+        goto error;
+    }
+
+    type_plans = PyDict_New();
+    forget_type_plan = PyCFunction_New(&type_plan_forget_def, NULL);
+    if(type_plans == NULL || forget_type_plan == NULL) {
+        goto error;
+    }
+
+    matcher_type = PyType_FromSpec(&Matcher_spec);
+    if(matcher_type == NULL || PyModule_AddObject(mod, "Matcher", matcher_type)) {
+        goto error;
+    }
+
+    chunk_type = PyType_FromSpec(&Chunk_spec);
+    chunk_marker = chunk_type ? PyObject_CallObject(chunk_type, NULL) : NULL;
+    if(chunk_marker == NULL) {
+        goto error;
+    }
+
+    Py_INCREF(chunk_marker); // the module takes one reference, we keep the other
+    if(PyModule_AddObject(mod, "CHUNK", chunk_marker)) {
+        goto error;
+    }
+
+    key_cache_type = PyType_FromSpec(&KeyCache_spec);
+    if(key_cache_type == NULL || PyModule_AddObject(mod, "KeyCache", key_cache_type)) {
+        goto error;
+    }
+
+    dedupe_type = PyType_FromSpec(&DedupeTable_spec);
+    if(dedupe_type == NULL || PyModule_AddObject(mod, "DedupeTable", dedupe_type)) {
+        goto error;
+    }
+
+    if(PyModule_AddObject(mod, "Codec", PyType_FromSpec(&Codec_spec))) {
+        goto error;
+    }
+
     if(PyModule_AddIntConstant(mod, "ENCODE_AS_STR", encode_type::str)) {
         goto error;
     }
@@ -7,8 +7,9 @@ setup(
     version="2.1.2",
     description="Earl-etf, the fanciest External Term Format packer and unpacker available for Python.",
     ext_modules=[module1],
+    py_modules=['earl_pool'],
     test_suite='unit_tests',
-    python_requires='>=3',
+    python_requires='>=3.8',
     url="https://github.com/ccubed/Earl",
     author="Charles Click",
     author_email="CharlesClick@vertinext.com",
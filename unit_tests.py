@@ -1,7 +1,33 @@
 # -*- coding: utf-8; -*-
 import unittest
+import dataclasses
+import io
+import enum
+import types
+import typing
+import collections
+import gc
+import os
+import sys
+import weakref
 import earl
 
+
+@dataclasses.dataclass
+class Point:
+    x: int
+    y: int
+
+
+class User(typing.NamedTuple):
+    id: int
+    name: bytes
+
+
+class Color(enum.Enum):
+    red = 1
+
+
 class TestEarlPacking(unittest.TestCase):
     def test_smallint(self):
         self.assertEqual(earl.pack(10), bytes([131,97,10]))
@@ -21,6 +47,256 @@ class TestEarlPacking(unittest.TestCase):
     def test_nil(self):
         self.assertEqual(earl.pack([]), bytes([131,106]))
 
+    def test_dataclass(self):
+        self.assertEqual(earl.pack(Point(1, 2)), bytes([131,116,0,0,0,2,115,1,120,97,1,115,1,121,97,2]))
+
+    def test_namedtuple(self):
+        self.assertEqual(earl.pack(User(1, b"a")), earl.pack((1, b"a")))
+        self.assertEqual(earl.pack(User(1, b"a"), namedtuple_as_record=True),
+                         bytes([131,104,3,115,4,85,115,101,114,97,1,109,0,0,0,1,97]))
+
+    def test_enum(self):
+        self.assertEqual(earl.pack(Color.red), bytes([131,97,1]))
+        self.assertEqual(earl.pack(Color.red, enum_as_atom=True), bytes([131,115,3,114,101,100]))
+
+    def test_plan_lifetime(self):
+        cls = dataclasses.make_dataclass("Temporary", ["x"])
+        self.assertEqual(earl.pack(cls(1)), earl.pack({"x": 1}, encode_mode=earl.ENCODE_AS_ATOM))
+        ref = weakref.ref(cls)
+        del cls
+        gc.collect()
+        self.assertIsNone(ref())
+
+    def test_set(self):
+        self.assertEqual(earl.pack({1}), bytes([131,108,0,0,0,1,97,1,106]))
+        self.assertEqual(earl.pack(frozenset()), bytes([131,106]))
+
+    def test_mapping(self):
+        ordered = collections.OrderedDict([(1, 2), (3, 4)])
+        ordered.move_to_end(1)
+        self.assertEqual(earl.pack(ordered), earl.pack({3: 4, 1: 2}))
+        self.assertEqual(earl.pack(types.MappingProxyType({1: 2})), earl.pack({1: 2}))
+
+    def test_iterable(self):
+        self.assertEqual(earl.pack(x for x in (1, 2)), bytes([131,108,0,0,0,2,97,1,97,2,106]))
+        self.assertEqual(earl.pack(iter(())), bytes([131,106]))
+        self.assertEqual(earl.pack({1: 2}.keys()), earl.pack([1]))
+
+    def test_deterministic(self):
+        value = {"b": 1, "a": {2.0: 0, 1: 0}, (1,): 0, 3: 0}
+        reordered = {3: 0, (1,): 0, "a": {1: 0, 2.0: 0}, "b": 1}
+        self.assertEqual(earl.pack(value, deterministic=True), earl.pack(reordered, deterministic=True))
+        self.assertEqual(list(earl.unpack(earl.pack(value, deterministic=True))), [3, (1,), b"a", b"b"])
+        self.assertEqual(earl.pack({"b", "a"}, deterministic=True), earl.pack([b"a", b"b"]))
+
+    def test_deterministic_ties(self):
+        self.assertEqual(earl.pack({"a": 1, b"a": 2}, deterministic=True),
+                         earl.pack({b"a": 2, "a": 1}, deterministic=True))
+        nan = float("nan")
+        keys = [nan, 1.5, float("nan"), -1.0]
+        packed = earl.pack(dict.fromkeys(keys, 0), deterministic=True)
+        self.assertEqual(packed, earl.pack(dict.fromkeys(reversed(keys), 0), deterministic=True))
+        self.assertEqual(list(earl.unpack(packed))[:2], [-1.0, 1.5])
+
+    def test_digest(self):
+        packed, digest = earl.pack({"a": [1, 2]}, digest=True)
+        self.assertEqual(packed, earl.pack({"a": [1, 2]}))
+        self.assertEqual(earl.pack(b"", digest=True)[1], 0x44b5ecf7fb8b3c8a)
+        self.assertEqual(earl.pack_to({"a": [1, 2]}, io.BytesIO(), chunk_size=4, digest=True), (len(packed), digest))
+        packed, digest = earl.pack([b"y" * 100], digest=True)
+        self.assertEqual(earl.pack_to([b"y" * 100], io.BytesIO(), chunk_size=16, digest=True), (len(packed), digest))
+        self.assertEqual(earl.pack_to([b"y" * 100], io.BytesIO(), chunk_size=16, compressed=True, digest=True)[1], digest)
+
+
+class TestEarlStreaming(unittest.TestCase):
+    def test_chunks(self):
+        value = {"a": list(range(1000)), "b": b"x" * 5000}
+        out = io.BytesIO()
+        self.assertEqual(earl.pack_to(value, out, chunk_size=64), len(earl.pack(value)))
+        self.assertEqual(out.getvalue(), earl.pack(value))
+
+    def test_compressed(self):
+        value = [1, 2, 3] * 100
+        out = io.BytesIO()
+        earl.pack_to(value, out, compressed=True)
+        self.assertEqual(out.getvalue()[:6], bytes([131,80,0,0,2,94]))
+        self.assertEqual(earl.unpack(out.getvalue()), value)
+
+    def test_iterable(self):
+        out = io.BytesIO()
+        earl.pack_to(({"a": x} for x in range(100)), out, chunk_size=16)
+        self.assertEqual(out.getvalue(), earl.pack([{"a": x} for x in range(100)]))
+        self.assertRaises(earl.EncodeError, earl.pack_to, iter([1]), io.BytesIO(), compressed=True)
+        out = io.BytesIO()
+        self.assertRaises(earl.EncodeError, earl.pack_to, [1, iter([1, 2, 3])], out, compressed=True)
+        self.assertEqual(out.getvalue(), b"")
+
+
+    def test_writer_results(self):
+        class Blocking(io.RawIOBase):
+            def writable(self):
+                return True
+
+            def write(self, data):
+                return None
+
+        self.assertRaises(BlockingIOError, earl.pack_to, [1, 2], Blocking())
+
+        class Short(io.RawIOBase):
+            def __init__(self):
+                self.chunks = []
+
+            def writable(self):
+                return True
+
+            def write(self, data):
+                self.chunks.append(data)
+                return min(len(data), 7)
+
+        blob = b"z" * 100
+        out = Short()
+        earl.pack_to([blob, bytearray(b"w" * 40)], out, chunk_size=16)
+        self.assertIs(out.chunks[2], blob)
+        self.assertTrue(all(isinstance(chunk, memoryview) for chunk in out.chunks[3:17]))
+        self.assertEqual(b"".join(bytes(chunk[:7]) for chunk in out.chunks), earl.pack([blob, b"w" * 40]))
+        self.assertEqual(earl.pack_to(1, io.BytesIO(), chunk_size=2**62), 3)
+
+class TestEarlChunked(unittest.TestCase):
+    def test_list(self):
+        items = [{"id": i, "name": "x" * (i % 20)} for i in range(200)]
+        chunks = earl.pack_chunked(items, 300, wrap={"op": 0, "d": earl.CHUNK})
+        self.assertGreater(len(chunks), 1)
+        self.assertTrue(all(len(chunk) <= 300 for chunk in chunks))
+        decoded = [earl.unpack(chunk) for chunk in chunks]
+        self.assertTrue(all(value[b"op"] == 0 for value in decoded))
+        self.assertEqual(sum((value[b"d"] for value in decoded), []), earl.unpack(earl.pack(items)))
+
+    def test_mapping(self):
+        value = {i: b"v" * i for i in range(50)}
+        chunks = earl.pack_chunked(value, 200, wrap=lambda chunk: (1, chunk))
+        merged = {}
+        for chunk in chunks:
+            self.assertLessEqual(len(chunk), 200)
+            merged.update(earl.unpack(chunk)[1])
+        self.assertEqual(merged, value)
+
+    def test_deterministic(self):
+        self.assertEqual(earl.pack_chunked({"b": 1, "a": 2}, 100, deterministic=True),
+                         earl.pack_chunked({"a": 2, "b": 1}, 100, deterministic=True))
+        self.assertEqual(earl.pack_chunked({3, 1, 2}, 12, deterministic=True),
+                         [earl.pack([1, 2]), earl.pack([3])])
+        self.assertEqual(earl.pack_chunked([3, 1, 2], 100, deterministic=True), [earl.pack([3, 1, 2])])
+
+    def test_marker(self):
+        self.assertRaises(earl.EncodeError, earl.pack, earl.CHUNK)
+        self.assertRaises(earl.EncodeError, earl.pack_chunked, [earl.CHUNK], 100)
+        self.assertEqual(earl.pack_chunked([1], 100, wrap=(earl.CHUNK, 2)), [earl.pack(([1], 2))])
+
+    def test_limits(self):
+        self.assertEqual(earl.pack_chunked([], 100), [bytes([131,106])])
+        self.assertEqual(earl.pack_chunked([1, 2], 9), [bytes([131,108,0,0,0,1,97,1,106]), bytes([131,108,0,0,0,1,97,2,106])])
+        self.assertRaises(earl.EncodeError, earl.pack_chunked, [b"x" * 100], 50)
+        self.assertRaises(ValueError, earl.pack_chunked, [1], 100, wrap=[1])
+
+
+class TestEarlIov(unittest.TestCase):
+    def test_reference(self):
+        blob = b"x" * 100
+        segments = earl.pack_iov({"b": blob, "c": b"small"}, min_ref_size=64)
+        self.assertTrue(any(segment is blob for segment in segments))
+        self.assertEqual(b"".join(segments), earl.pack({"b": blob, "c": b"small"}))
+
+    def test_memoryview(self):
+        view = memoryview(bytearray(b"y" * 100))
+        segments = earl.pack_iov([view], min_ref_size=64)
+        self.assertEqual(b"".join(segments), earl.pack([b"y" * 100]))
+
+
+class TestEarlRing(unittest.TestCase):
+    def test_put_unpack(self):
+        ring = earl.Ring(bytearray(1024), create=True)
+        self.assertTrue(ring.put(earl.pack([1, 2, 3]), 7))
+        self.assertEqual(ring.stats()["pending_frames"], 1)
+        self.assertEqual(ring.unpack(), (7, [1, 2, 3]))
+        self.assertIsNone(ring.unpack())
+
+    def test_wrap(self):
+        ring = earl.Ring(bytearray(512), create=True)
+        for index in range(100):
+            self.assertTrue(ring.put(bytes(50), index))
+            self.assertEqual(ring.take(), (index, bytes(50)))
+        self.assertRaises(ValueError, ring.put, bytes(300))
+
+    def test_full(self):
+        ring = earl.Ring(bytearray(512), create=True)
+        self.assertTrue(ring.put(bytes(100)))
+        self.assertTrue(ring.put(bytes(100)))
+        self.assertFalse(ring.put(bytes(100)))
+
+    def test_release_while_unpacking(self):
+        ring = earl.Ring(bytearray(512), create=True)
+        errors = []
+
+        def factory(value):
+            try:
+                ring.release()
+            except BufferError as e:
+                errors.append(e)
+            return value
+
+        earl.register_record("release", 2, factory)
+        try:
+            ring.put(bytes([131,104,2,115,7]) + b"release" + bytes([97,1]), 3)
+            self.assertEqual(ring.unpack(), (3, 1))
+        finally:
+            earl.register_record("release", 2, None)
+        self.assertEqual(len(errors), 1)
+        ring.release()
+
+
+def summarize(value):
+    return value[b"op"], len(value[b"d"])
+
+
+def identity(value):
+    return value
+
+
+def crash(value):
+    os._exit(3)
+
+
+class TestEarlDecodePool(unittest.TestCase):
+    def test_map(self):
+        frames = [earl.pack({"op": index, "d": list(range(index))}) for index in range(50)]
+        with earl.DecodePool(2, ring_size=4096, fn=summarize) as pool:
+            self.assertEqual(pool.map(frames), [(index, index) for index in range(50)])
+            self.assertEqual(sum(worker["frames"] for worker in pool.stats()), 50)
+
+    def test_match(self):
+        frames = [earl.pack({"op": index, "d": [1, 2]}) for index in range(5)]
+        with earl.DecodePool(1, match=["op"]) as pool:
+            self.assertEqual(pool.map(frames), [(index,) for index in range(5)])
+
+    def test_strings(self):
+        value = ["nil", "true", "ok", "x" * 70000, b"raw"]
+        with earl.DecodePool(1, fn=identity, encoding="utf-8", encode_binary_ext=True) as pool:
+            frame = earl.pack(value)
+            self.assertEqual(pool.map([frame]), [earl.unpack(frame, encoding="utf-8", encode_binary_ext=True)])
+
+    def test_errors(self):
+        self.assertRaises(ValueError, earl.DecodePool, 1)
+        with earl.DecodePool(1, fn=identity, encoding="utf-8", encode_binary_ext=True) as pool:
+            bad = pool.submit(bytes([131,109,0,0,0,1,255]))
+            self.assertRaises(earl.DecodeError, pool.get, 10)
+            pool.submit(earl.pack(1))
+            self.assertEqual(pool.get(10), (bad + 1, 1))
+
+    def test_dead_worker(self):
+        with earl.DecodePool(1, fn=crash) as pool:
+            pool.submit(earl.pack(1))
+            self.assertRaises(RuntimeError, pool.get)
+
 
 class TestEarlUnpacking(unittest.TestCase):
     def test_smallint(self):
@@ -50,5 +326,164 @@ class TestEarlUnpacking(unittest.TestCase):
     def test_utf8(self):
         self.assertEqual(earl.unpack(bytes([131,107,0,6,233,153,176,233,153,189]), encoding="utf8"), "陰陽")
 
+    def test_validate(self):
+        data = earl.pack({"a": [1, (2, "x")]}, encode_mode=earl.ENCODE_AS_ATOM)
+        self.assertEqual(earl.validate(data), len(data))
+        self.assertEqual(earl.unpack(data, validate=True), {"a": [1, (2, "x")]})
+
+    def test_validate_errors(self):
+        cases = [
+            (bytes([131,108,0,0,0,1,97,1,97]), ("Expected NIL_EXT after list", 8)),
+            (bytes([131,99]), ("Unexpected opcode", 1)),
+            (bytes([131,115,2,195,40]), ("Invalid UTF-8", 3)),
+            (bytes([131,108,255,255,255,255]), ("Unexpected end of byte string", 6)),
+        ]
+        for data, error in cases:
+            with self.assertRaises(earl.DecodeError) as context:
+                earl.unpack(data, validate=True)
+            self.assertEqual(context.exception.args, error)
+        self.assertRaises(earl.DecodeError, earl.validate, bytes([131,107,0,1,255]), encoding="utf-8")
+        self.assertEqual(earl.validate(bytes([131,107,0,1,255])), 5)
+
+class TestEarlKeyCache(unittest.TestCase):
+    def test_keys(self):
+        cache = earl.KeyCache(16)
+        data = earl.pack([{"id": 1, "guild_id": 2}, {"id": 3, "guild_id": 4}])
+        first, second = earl.unpack(data, key_cache=cache, encoding="utf-8", encode_binary_ext=True)
+        self.assertEqual(first, {"id": 1, "guild_id": 2})
+        self.assertIs(list(first)[0], list(second)[0])
+        self.assertEqual((cache.stats()["hits"], cache.stats()["misses"]), (2, 2))
+
+    def test_bypass(self):
+        cache = earl.KeyCache(max_key_size=4)
+        data = earl.pack({"long_key": 1, "id": {"id": 2}})
+        self.assertEqual(earl.unpack(data, key_cache=cache), {b"long_key": 1, b"id": {b"id": 2}})
+        self.assertEqual(earl.unpack(data, key_cache=cache, encoding="utf-8", encode_binary_ext=True),
+                         {"long_key": 1, "id": {"id": 2}})
+        self.assertEqual(cache.stats()["entries"], 1)
+        self.assertRaises(TypeError, earl.unpack, data, key_cache={})
+
+    def test_eviction_frees_keys(self):
+        cache = earl.KeyCache(4)
+        key = list(earl.unpack(earl.pack({"user_1234": 1}), key_cache=cache, encoding="utf-8",
+                               encode_binary_ext=True))[0]
+        cache.clear()
+        # only this frame and getrefcount's argument hold it, so the key isn't interned
+        self.assertEqual(sys.getrefcount(key), 2)
+
+class TestEarlDedupe(unittest.TestCase):
+    def test_shared(self):
+        data = earl.pack([(b"chan", 1.5, 10**6), (b"chan", 1.5, 10**6), 2.5, 2.5, [1], [1]])
+        value = earl.unpack(data, dedupe=True)
+        self.assertEqual(value, earl.unpack(data))
+        self.assertIs(value[0], value[1])
+        self.assertIs(value[2], value[3])
+        self.assertIsNot(value[4], value[5])
+
+    def test_nested(self):
+        value = (list(range(300)), 1)
+        for _ in range(5):
+            value = (value, (b"x", 2.5))
+        data = earl.pack([value, value])
+        decoded = earl.unpack(data, dedupe=True)
+        self.assertEqual(decoded, earl.unpack(data))
+        self.assertIsNot(decoded[0], decoded[1])
+        self.assertIs(decoded[0][1], decoded[1][1])
+
+    def test_table(self):
+        table = earl.DedupeTable(max_span=12)
+        data = earl.pack([b"short", b"a longer binary"])
+        first = earl.unpack(data, dedupe=table)
+        second = earl.unpack(data, dedupe=table)
+        self.assertIs(first[0], second[0])
+        self.assertIsNot(first[1], second[1])
+        stats = table.stats()
+        self.assertEqual((stats["hits"], stats["misses"], stats["entries"]), (1, 1, 1))
+        self.assertEqual(stats["bytes_saved"], b"short".__sizeof__())
+        table.clear()
+        self.assertEqual(table.stats()["entries"], 0)
+
+    def test_options(self):
+        table = earl.DedupeTable()
+        data = earl.pack(["abcdef", "abcdef"])
+        self.assertEqual(earl.unpack(data, dedupe=table), [b"abcdef", b"abcdef"])
+        self.assertRaises(ValueError, earl.unpack, data, dedupe=table, encoding="utf-8", encode_binary_ext=True)
+        table.clear()
+        self.assertEqual(earl.unpack(data, dedupe=table, encoding="utf8", encode_binary_ext=True), ["abcdef", "abcdef"])
+        self.assertEqual(earl.unpack(data, dedupe=table, encoding="utf-8", encode_binary_ext=True), ["abcdef", "abcdef"])
+
+class TestEarlPeek(unittest.TestCase):
+    data = bytes([131,116,0,0,0,2,100,0,1,116,109,0,0,0,2,104,105,
+                  100,0,1,100,104,2,97,1,108,0,0,0,2,97,2,97,3,106])
+
+    def test_key(self):
+        self.assertEqual(earl.peek(self.data, "t"), b"hi")
+
+    def test_path(self):
+        self.assertEqual(earl.peek(self.data, ("d", 1, 0)), 2)
+
+    def test_missing(self):
+        self.assertIsNone(earl.peek(self.data, "x", None))
+        self.assertRaises(KeyError, earl.peek, self.data, "x")
+
+    def test_span(self):
+        start, end = earl.peek(self.data, "d", span=True)
+        self.assertEqual(earl.unpack(b"\x83" + self.data[start:end]), (1, [2, 3]))
+
+    def test_matcher(self):
+        matcher = earl.Matcher(["t", ("d", 0), "x"])
+        self.assertEqual(matcher.match(self.data), (b"hi", 1, None))
+
+class TestEarlRecords(unittest.TestCase):
+    def tearDown(self):
+        earl.register_record("user", 3, None)
+
+    def test_namedtuple(self):
+        earl.register_record("user", 3, User)
+        value = earl.unpack(bytes([131,104,3,100,0,4,117,115,101,114,97,1,109,0,0,0,1,97]))
+        self.assertIsInstance(value, User)
+        self.assertEqual(value, User(1, b"a"))
+
+    def test_factory(self):
+        earl.register_record("user", 3, lambda id, name: {"id": id, "name": name})
+        value = earl.unpack(bytes([131,104,3,115,4,117,115,101,114,97,1,109,0,0,0,1,97]))
+        self.assertEqual(value, {"id": 1, "name": b"a"})
+
+    def test_arity_mismatch(self):
+        earl.register_record("user", 3, User)
+        self.assertEqual(earl.unpack(bytes([131,104,2,115,4,117,115,101,114,97,1])), ("user", 1))
+
+    def test_register_while_packing(self):
+        class Registering:
+            def __iter__(self):
+                earl.register_record("user", 3, User)
+                return iter([User(1, b"a")])
+
+        packed = earl.pack(Point(Registering(), 2), namedtuple_as_record=True)
+        self.assertEqual(earl.unpack(packed), {"x": [User(1, b"a")], "y": 2})
+
+class TestEarlCodec(unittest.TestCase):
+    def test_roundtrip(self):
+        codec = earl.Codec("utf-8", encode_mode=earl.ENCODE_AS_STR)
+        value = {"name": "Zoë", "tags": [1, 2.5, ("ok", True)]}
+        packed = codec.pack(value)
+        self.assertEqual(packed, earl.pack(value, encode_mode=earl.ENCODE_AS_STR))
+        self.assertEqual(codec.unpack(packed), earl.unpack(packed, encoding="utf-8"))
+        self.assertEqual(codec.pack(1), earl.pack(1))
+
+    def test_other_encoding(self):
+        codec = earl.Codec("latin-1")
+        self.assertEqual(codec.pack("é"), bytes([131,109,0,0,0,1,233]))
+        self.assertEqual(codec.unpack(bytes([131,107,0,1,233])), "é")
+        self.assertEqual(codec.encoding, "latin-1")
+
+    def test_arguments(self):
+        codec = earl.Codec()
+        self.assertRaises(TypeError, codec.pack)
+        self.assertRaises(TypeError, codec.unpack, b"", b"")
+        self.assertRaises(TypeError, earl.pack, 1, bogus=True)
+        self.assertRaises(TypeError, earl.unpack, bytes([131,97,1]), "utf-8", False)
+        self.assertEqual(earl.unpack(data=bytes([131,107,0,1,97]), encoding="utf8"), "a")
+
 if __name__ == "__main__":
     unittest.main()